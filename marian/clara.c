@@ -16,6 +16,8 @@
  */
 
 #include <linux/pci.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <sound/pcm.h>
 #include "dbg_out.h"
 #include "device_generic.h"
@@ -40,6 +42,7 @@ static void chip_free(struct generic_chip *chip)
 		return;
 	if (clara_chip->specific_free != NULL)
 		clara_chip->specific_free(chip);
+	dma_ng_free(chip);
 	release_pci_resources(chip);
 	kfree(clara_chip);
 	chip->specific = NULL;
@@ -69,6 +72,7 @@ int clara_chip_new(struct snd_card *card,
 
 	chip->specific = clara_chip;
 	chip->specific_free = chip_free;
+	dma_ng_init(chip);
 
 	/* get PCI resources presumes that the generic chip function has
 	 * already acquired PCI regions and BAR0. */
@@ -148,45 +152,41 @@ void clara_soft_reset(struct generic_chip *chip)
 	// TODO ToG: reset IRQs / DMA engine
 }
 
-static int alloc_dma_buffers(struct pci_dev *pci_dev,
-	struct generic_chip *chip,
-	size_t playback_size, size_t capture_size)
+static int alloc_dma_buffer(struct pci_dev *pci_dev, int type, size_t size,
+	struct snd_dma_buffer *buf, char const *dir)
 {
-	struct snd_dma_buffer tmp_buf;
-	if (snd_dma_alloc_pages(SNDRV_DMA_TYPE_DEV, &pci_dev->dev,
-		capture_size, &tmp_buf) == 0) {
-		PRINT_DEBUG("area = 0x%p\n", tmp_buf.area);
-		PRINT_DEBUG("addr = 0x%llu\n", tmp_buf.addr);
-		PRINT_DEBUG("bytes = %zu\n", tmp_buf.bytes);
-		chip->capture_buf = tmp_buf;
-	} else {
-		PRINT_ERROR(
-			"snd_dma_alloc_dir_pages failed (capture)\n");
-		return -ENOMEM;
-	}
-	if (snd_dma_alloc_pages(SNDRV_DMA_TYPE_DEV, &pci_dev->dev,
-		playback_size, &tmp_buf) == 0) {
-		PRINT_DEBUG("area = 0x%p\n", tmp_buf.area);
-		PRINT_DEBUG("addr = 0x%llu\n", tmp_buf.addr);
-		PRINT_DEBUG("bytes = %zu\n", tmp_buf.bytes);
-		chip->playback_buf = tmp_buf;
-	} else {
-		PRINT_ERROR(
-			"snd_dma_alloc_dir_pages failed (playback)\n");
-		return -ENOMEM;
+	if (snd_dma_alloc_pages(type, &pci_dev->dev, size, buf) == 0) {
+		generic_sync_dma_buffer(buf);
+		PRINT_DEBUG("area = 0x%p\n", buf->area);
+		PRINT_DEBUG("addr = 0x%llu\n", buf->addr);
+		PRINT_DEBUG("bytes = %zu\n", buf->bytes);
+		return 0;
 	}
-	return 0;
+	PRINT_ERROR("snd_dma_alloc_dir_pages failed (%s)\n", dir);
+	memset(buf, 0, sizeof(*buf));
+	return -ENOMEM;
 }
 
+/* The buffers are normally allocated in hw_params with the size of the
+ * configuration. Only the part requested by dma_prealloc_bytes, capped to
+ * the largest configuration, is allocated here. */
 int clara_alloc_dma_buffers(struct pci_dev *pci_dev,
 	struct generic_chip *chip)
 {
 	struct clara_chip *clara_chip = chip->specific;
-	return alloc_dma_buffers(pci_dev, chip,
-		DMA_BLOCK_SIZE_BYTES * clara_chip->max_num_dma_blocks *
-			chip->max_num_channels,
+	size_t const size = min_t(size_t, chip->dma_prealloc_bytes,
 		DMA_BLOCK_SIZE_BYTES * clara_chip->max_num_dma_blocks *
 			chip->max_num_channels);
+	int err = 0;
+
+	if (size == 0)
+		return 0;
+	err = alloc_dma_buffer(pci_dev, chip->capture_dma_type, size,
+		&chip->capture_prealloc, "capture");
+	if (err < 0)
+		return err;
+	return alloc_dma_buffer(pci_dev, chip->playback_dma_type, size,
+		&chip->playback_prealloc, "playback");
 }
 
 void clara_timer_callback(struct generic_chip *chip)
@@ -198,8 +198,118 @@ void clara_timer_callback(struct generic_chip *chip)
 	PCM FUNCTIONS
 */
 
+/* The DMA engine fetches playback data one block ahead of the sample counter
+ * and writes capture data once a block is complete, so each direction is
+ * delayed by one block. The transport inside the card adds to that, but
+ * only by what the user measured and passed as parameter. */
+static snd_pcm_sframes_t get_delay(struct generic_chip *chip, int stream)
+{
+	return DMA_SAMPLES_PER_BLOCK +
+		((stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+			chip->playback_transport_frames :
+			chip->capture_transport_frames);
+}
+
 snd_pcm_uframes_t clara_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	return clara_pointer(snd_pcm_substream_chip(substream), substream);
+}
+
+/* With pointer interpolation the sample counter is estimated from the value
+ * read in the last IRQ (or the last register read) as long as that is not
+ * older than one page, which is the IRQ interval of the DMA engine.
+ * The substream does not need to belong to the chip, the aggregate PCM reads
+ * the position from one of its cards. */
+snd_pcm_uframes_t clara_pointer(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
+{
+	struct clara_chip *clara_chip = chip->specific;
+	u32 sample_counter;
+	unsigned long irq_flags;
+
+	substream->runtime->delay = get_delay(chip, substream->stream);
+	if (chip->pointer_interpolation) {
+		spin_lock_irqsave(&chip->lock, irq_flags);
+		if (generic_interpolate_sample_counter(chip, ktime_get(),
+			clara_chip->dma.page_time, DMA_SAMPLES_PER_BLOCK,
+			&sample_counter)) {
+			generic_update_frame_count(chip, sample_counter);
+			spin_unlock_irqrestore(&chip->lock, irq_flags);
+			return sample_counter;
+		}
+		spin_unlock_irqrestore(&chip->lock, irq_flags);
+	}
+
+	// read under the lock, so the readings of both directions and the IRQ
+	// reach the frame count in the order they were taken
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	sample_counter = generic_get_sample_counter(chip);
+	generic_store_sample_counter(chip, sample_counter, ktime_get());
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+	return sample_counter;
+}
+
+static ktime_t get_system_time(struct snd_pcm_runtime *runtime)
+{
+	switch (runtime->tstamp_type) {
+	case SNDRV_PCM_TSTAMP_TYPE_MONOTONIC:
+		return ktime_get();
+	case SNDRV_PCM_TSTAMP_TYPE_MONOTONIC_RAW:
+		return ktime_get_raw();
+	default:
+		return ktime_get_real();
+	}
+}
+
+/* Reports the link time derived from the FPGA sample counter. The system
+ * time stamp is taken around the register read, so both refer to the same
+ * moment within the accuracy that is reported. */
+int clara_pcm_get_time_info(struct snd_pcm_substream *substream,
+	struct timespec64 *system_ts, struct timespec64 *audio_ts,
+	struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+	struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
 {
 	struct generic_chip *chip = snd_pcm_substream_chip(substream);
-	return generic_get_sample_counter(chip);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	ktime_t before, after;
+	u32 sample_counter;
+	u64 frames;
+	unsigned long irq_flags;
+
+	if (audio_tstamp_config->type_requested !=
+		SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK &&
+		audio_tstamp_config->type_requested !=
+		SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_ABSOLUTE) {
+		audio_tstamp_report->actual_type =
+			SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+	if (runtime->rate == 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	before = get_system_time(runtime);
+	sample_counter = generic_get_sample_counter(chip);
+	after = get_system_time(runtime);
+	frames = generic_update_frame_count(chip, sample_counter);
+	// link time is relative to the trigger, absolute link time to the
+	// start of the DMA engine
+	if (audio_tstamp_config->type_requested ==
+		SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK)
+		frames -= (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+			chip->playback_start_frames[substream->number] :
+			chip->capture_start_frames[substream->number];
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+
+	*system_ts = ktime_to_timespec64(ktime_add_ns(before,
+		ktime_to_ns(ktime_sub(after, before)) / 2));
+	*audio_ts = ns_to_timespec64(div_u64(frames * NSEC_PER_SEC,
+		runtime->rate));
+	audio_tstamp_report->actual_type = audio_tstamp_config->type_requested;
+	audio_tstamp_report->accuracy_report = 1;
+	// the counter is read somewhere in between the two time stamps
+	// and only advances in full samples
+	audio_tstamp_report->accuracy = ktime_to_ns(ktime_sub(after, before))
+		/ 2 + div_u64(NSEC_PER_SEC, runtime->rate);
+	return 0;
 }
\ No newline at end of file
@@ -19,12 +19,14 @@
 #include <linux/pci.h>
 #include <sound/core.h>
 #include "device_generic.h"
+#include "dma_ng.h"
 
 struct clara_chip {
 	unsigned long bar1_addr;
 	void __iomem *bar1;
 	u16 max_num_dma_blocks;
-	u16 channels_per_dma_slice;
+	u16 max_channels_per_dma_slice;
+	struct dma_ng dma;
 	void *specific;
 	chip_free_func specific_free;
 };
@@ -45,3 +47,9 @@ bool clara_detect_hw_presence(struct generic_chip *chip);
 void clara_soft_reset(struct generic_chip *chip);
 void clara_timer_callback(struct generic_chip *chip);
 snd_pcm_uframes_t clara_pcm_pointer(struct snd_pcm_substream *substream);
+snd_pcm_uframes_t clara_pointer(struct generic_chip *chip,
+	struct snd_pcm_substream *substream);
+int clara_pcm_get_time_info(struct snd_pcm_substream *substream,
+	struct timespec64 *system_ts, struct timespec64 *audio_ts,
+	struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+	struct snd_pcm_audio_tstamp_report *audio_tstamp_report);
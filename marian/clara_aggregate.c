@@ -0,0 +1,606 @@
+/*
+ * MARIAN PCIe soundcards ALSA driver
+ *
+ * Author: Tobias Groß <theguy@audio-fpga.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include <linux/types.h>
+#include <linux/pci.h>
+#include <linux/mutex.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include <sound/pcm_params.h>
+#include "dbg_out.h"
+#include "device_abstraction.h"
+#include "device_generic.h"
+#include "clara.h"
+#include "clara_e.h"
+#include "clara_aggregate.h"
+#include "dma_ng.h"
+#include "pcm_copy.h"
+
+/* The aggregate PCM uses one buffer for all cards, so the channels of all
+ * cards are contiguous. Each card transfers its channels to its part of the
+ * buffer with its own DMA engine, only the first card raises period IRQs and
+ * provides the position. The cards need to be synchronized to the same Dante
+ * clock, the engines are started together like linked substreams.
+ * The directions of the cards are claimed from open until close, meanwhile
+ * the PCMs of the cards themselves cannot be opened for them. */
+
+struct aggregate_member {
+	// NULL if the slot is not used
+	struct generic_chip *chip;
+	// set from open to close if the card is part of the substream
+	bool claimed[2];
+	// set from hw_params to hw_free
+	bool configured[2];
+	// position of the channels of the card within the aggregate PCM
+	unsigned int channel_offset[2];
+	unsigned int num_channels[2];
+	// the buffer is allocated for the first card, the others access it
+	// through a mapping of their own
+	struct sg_table sgt[2];
+	bool mapped[2];
+	dma_addr_t dma_addr[2];
+};
+
+struct aggregate {
+	// the first slot holds the card the PCM belongs to
+	struct aggregate_member members[CLARA_AGGREGATE_MAX_CARDS];
+	struct snd_pcm *pcm;
+	struct snd_pcm_substream *substreams[2];
+	struct snd_dma_buffer bufs[2];
+};
+
+/* Serializes cards coming and going with the PCM callbacks that may sleep.
+ * Trigger and pointer run without it, they only access the cards while the
+ * substream is running, and cards only leave after stopping it for good.
+ * The pointer may also be queried outside of that, so the slots are changed
+ * under aggregate_lock as well, which the pointer holds while reading the
+ * position from the first card. */
+static DEFINE_MUTEX(aggregate_mutex);
+static DEFINE_SPINLOCK(aggregate_lock);
+static struct aggregate aggregate;
+
+#define for_each_member(__m__) \
+	for ((__m__) = aggregate.members; \
+		(__m__) < aggregate.members + CLARA_AGGREGATE_MAX_CARDS; \
+		(__m__)++) \
+		if ((__m__)->chip != NULL)
+
+static struct device *buffer_owner(void)
+{
+	return &aggregate.members[0].chip->pci_dev->dev;
+}
+
+/* The buffer is coherent memory (SNDRV_DMA_TYPE_DEV) of the first card.
+ * Another card reaches it through a streaming mapping on its own device,
+ * which gets an address in the IOMMU domain of that card if there is one
+ * and does whatever cache maintenance the card needs on mapping. */
+static int map_buffer(struct aggregate_member *m, int stream)
+{
+	struct snd_dma_buffer *buf = &aggregate.bufs[stream];
+	struct sg_table *sgt = &m->sgt[stream];
+	int err = 0;
+
+	if (m == aggregate.members) {
+		m->dma_addr[stream] = buf->addr;
+		return 0;
+	}
+	err = dma_get_sgtable(buffer_owner(), sgt, buf->area, buf->addr,
+		buf->bytes);
+	if (err < 0)
+		return err;
+	err = dma_map_sgtable(&m->chip->pci_dev->dev, sgt,
+		DMA_BIDIRECTIONAL, 0);
+	if (err < 0) {
+		sg_free_table(sgt);
+		return err;
+	}
+	m->mapped[stream] = true;
+	// the engine needs one address range for all channels of a card
+	if (sgt->nents != 1) {
+		PRINT_ERROR("aggregate: buffer not contiguous for card %s\n",
+			m->chip->card->shortname);
+		return -EIO;
+	}
+	m->dma_addr[stream] = sg_dma_address(sgt->sgl);
+	return 0;
+}
+
+static void unmap_buffer(struct aggregate_member *m, int stream)
+{
+	if (!m->mapped[stream])
+		return;
+	dma_unmap_sgtable(&m->chip->pci_dev->dev, &m->sgt[stream],
+		DMA_BIDIRECTIONAL, 0);
+	sg_free_table(&m->sgt[stream]);
+	m->mapped[stream] = false;
+}
+
+// the caller needs to hold aggregate_mutex
+static void release_member(struct aggregate_member *m,
+	struct snd_pcm_substream *substream)
+{
+	int const stream = substream->stream;
+
+	if (m->configured[stream])
+		clara_e_dir_hw_free(m->chip, substream);
+	m->configured[stream] = false;
+	unmap_buffer(m, stream);
+}
+
+// the caller needs to hold aggregate_mutex
+static void unclaim_member(struct aggregate_member *m, int stream)
+{
+	__maybe_unused unsigned long irq_flags;
+
+	if (!m->claimed[stream])
+		return;
+	LOCK_ACQUIRE(&m->chip->lock, irq_flags);
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		m->chip->playback_aggregated = false;
+	else
+		m->chip->capture_aggregated = false;
+	LOCK_RELEASE(&m->chip->lock, irq_flags);
+	m->claimed[stream] = false;
+}
+
+/* Claims the direction of a card for the aggregate PCM. Also returns the
+ * buffer size of the other direction of the card if that is configured.
+ * The caller needs to hold aggregate_mutex. */
+static int claim_member(struct aggregate_member *m, int stream,
+	unsigned int *rnum_buffer_frames)
+{
+	struct generic_chip *chip = m->chip;
+	__maybe_unused unsigned long irq_flags;
+
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	if (chip->pcm->streams[stream].substream_opened > 0) {
+		LOCK_RELEASE(&chip->lock, irq_flags);
+		PRINT_ERROR("aggregate: card %s is in use\n",
+			chip->card->shortname);
+		return -EBUSY;
+	}
+	*rnum_buffer_frames = generic_configured(chip,
+		(stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		SNDRV_PCM_STREAM_CAPTURE : SNDRV_PCM_STREAM_PLAYBACK) ?
+		chip->num_buffer_frames : 0;
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		chip->playback_aggregated = true;
+	else
+		chip->capture_aggregated = true;
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	m->claimed[stream] = true;
+	return 0;
+}
+
+static int pcm_open(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int const stream = substream->stream;
+	struct aggregate_member *m = NULL;
+	struct generic_chip *first = NULL;
+	struct clara_e_chip *clara_e_chip = NULL;
+	unsigned int rate = 0;
+	unsigned int channels = 0;
+	unsigned int num_buffer_frames = 0;
+	enum clock_mode cmode = CLOCK_MODE_48;
+	int err = 0;
+
+	mutex_lock(&aggregate_mutex);
+	first = aggregate.members[0].chip;
+	if (first == NULL) {
+		err = -ENODEV;
+		goto unlock;
+	}
+	clara_e_chip = ((struct clara_chip *)first->specific)->specific;
+	rate = atomic_read(&first->current_sample_rate);
+	cmode = generic_sample_rate_to_clock_mode(rate);
+	if (cmode > CLOCK_MODE_192) {
+		PRINT_ERROR("aggregate: invalid clock mode: %d\n", cmode);
+		err = -EINVAL;
+		goto unlock;
+	}
+
+	for_each_member(m) {
+		unsigned int member_channels = 0;
+		unsigned int member_frames = 0;
+
+		if (atomic_read(&m->chip->current_sample_rate) != rate) {
+			PRINT_ERROR("aggregate: card %s does not run at %d Hz\n",
+				m->chip->card->shortname, rate);
+			err = -EINVAL;
+			goto unclaim;
+		}
+		member_channels = clara_e_num_channels(m->chip, stream, cmode);
+		if (member_channels == 0) {
+			PRINT_ERROR("aggregate: channel selection of card %s "
+				"does not fit\n", m->chip->card->shortname);
+			err = -EINVAL;
+			goto unclaim;
+		}
+		err = claim_member(m, stream, &member_frames);
+		if (err < 0)
+			goto unclaim;
+		// the other direction of the cards may already be in use
+		if (member_frames > 0) {
+			if (num_buffer_frames > 0 &&
+				num_buffer_frames != member_frames) {
+				PRINT_ERROR("aggregate: cards use different "
+					"buffer sizes\n");
+				err = -EBUSY;
+				goto unclaim;
+			}
+			num_buffer_frames = member_frames;
+		}
+		m->channel_offset[stream] = channels;
+		m->num_channels[stream] = member_channels;
+		channels += member_channels;
+	}
+
+	snd_pcm_hw_constraint_list(runtime, 0, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+		&(clara_e_chip->hw_constraints_period_sizes[cmode]));
+	snd_pcm_hw_constraint_step(runtime, 0, SNDRV_PCM_HW_PARAM_PERIODS,
+		DMA_NUM_PAGES);
+	if (num_buffer_frames > 0)
+		snd_pcm_hw_constraint_minmax(runtime,
+			SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+			num_buffer_frames, num_buffer_frames);
+	else
+		snd_pcm_hw_constraint_minmax(runtime,
+			SNDRV_PCM_HW_PARAM_BUFFER_SIZE, 0,
+			DMA_MAX_NUM_BLOCKS * DMA_SAMPLES_PER_BLOCK);
+	runtime->hw = first->hw_caps_playback;
+	// link time stamps would need the counters of all cards
+	runtime->hw.info &= ~(SNDRV_PCM_INFO_HAS_LINK_ATIME |
+		SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME);
+	runtime->hw.rate_min = rate;
+	runtime->hw.rate_max = rate;
+	runtime->hw.channels_min = channels;
+	runtime->hw.channels_max = channels;
+	runtime->hw.buffer_bytes_max = DMA_BLOCK_SIZE_BYTES *
+		DMA_MAX_NUM_BLOCKS * channels;
+	runtime->hw.period_bytes_min = DMA_BLOCK_SIZE_BYTES * channels;
+	runtime->hw.period_bytes_max = runtime->hw.buffer_bytes_max /
+		DMA_MIN_NUM_PERIODS;
+	err = pcm_copy_open(substream, 0);
+	if (err < 0)
+		goto unclaim;
+	aggregate.substreams[stream] = substream;
+	PRINT_DEBUG("aggregate: open with %d channels\n", channels);
+	mutex_unlock(&aggregate_mutex);
+	return 0;
+
+unclaim:
+	for_each_member(m)
+		unclaim_member(m, stream);
+unlock:
+	mutex_unlock(&aggregate_mutex);
+	return err;
+}
+
+static int pcm_close(struct snd_pcm_substream *substream)
+{
+	struct aggregate_member *m = NULL;
+
+	mutex_lock(&aggregate_mutex);
+	for_each_member(m)
+		unclaim_member(m, substream->stream);
+	aggregate.substreams[substream->stream] = NULL;
+	mutex_unlock(&aggregate_mutex);
+	return 0;
+}
+
+// the caller needs to hold aggregate_mutex
+static void release_buffer(struct snd_pcm_substream *substream)
+{
+	struct aggregate_member *m = NULL;
+	int const stream = substream->stream;
+
+	for_each_member(m)
+		release_member(m, substream);
+	if (aggregate.bufs[stream].area != NULL)
+		snd_dma_free_pages(&aggregate.bufs[stream]);
+	memset(&aggregate.bufs[stream], 0, sizeof(aggregate.bufs[stream]));
+	snd_pcm_set_runtime_buffer(substream, NULL);
+}
+
+static int pcm_hw_params(struct snd_pcm_substream *substream,
+	struct snd_pcm_hw_params *hw_params)
+{
+	int const stream = substream->stream;
+	struct aggregate_member *m = NULL;
+	size_t bytes = 0;
+	int err = 0;
+
+	mutex_lock(&aggregate_mutex);
+	// hw_params may be called again without hw_free in between
+	release_buffer(substream);
+	if (aggregate.members[0].chip == NULL) {
+		err = -ENODEV;
+		goto unlock;
+	}
+	// the buffer holds 32 bit samples whatever the format of the
+	// application is
+	bytes = (size_t)params_buffer_size(hw_params) *
+		params_channels(hw_params) * sizeof(u32);
+	err = snd_dma_alloc_pages(SNDRV_DMA_TYPE_DEV, buffer_owner(),
+		bytes, &aggregate.bufs[stream]);
+	if (err < 0) {
+		PRINT_ERROR("aggregate: could not allocate %zu bytes\n",
+			bytes);
+		goto unlock;
+	}
+	snd_pcm_set_runtime_buffer(substream, &aggregate.bufs[stream]);
+
+	for_each_member(m) {
+		if (!m->claimed[stream])
+			continue;
+		err = map_buffer(m, stream);
+		if (err < 0)
+			goto error;
+		err = clara_e_dir_hw_params(m->chip, substream,
+			params_rate(hw_params), params_buffer_size(hw_params));
+		if (err < 0)
+			goto error;
+		m->configured[stream] = true;
+	}
+	mutex_unlock(&aggregate_mutex);
+	return 0;
+
+error:
+	release_buffer(substream);
+unlock:
+	mutex_unlock(&aggregate_mutex);
+	return err;
+}
+
+static int pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	mutex_lock(&aggregate_mutex);
+	release_buffer(substream);
+	mutex_unlock(&aggregate_mutex);
+	return 0;
+}
+
+static int pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	int const stream = substream->stream;
+	struct aggregate_member *m = NULL;
+	int err = 0;
+
+	// the buffer spans the channels of all cards, so it is cleared here
+	// rather than in the trigger, where it would take too long
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		memset(runtime->dma_area, 0, runtime->dma_bytes);
+	mutex_lock(&aggregate_mutex);
+	for_each_member(m) {
+		if (!m->configured[stream])
+			continue;
+		// one card signals the periods for all of them
+		err = clara_e_dir_prepare(m->chip, substream,
+			m->dma_addr[stream] + (u64)m->channel_offset[stream] *
+				runtime->buffer_size * sizeof(u32),
+			m->num_channels[stream],
+			m == aggregate.members && !runtime->no_period_wakeup);
+		if (err < 0)
+			break;
+	}
+	mutex_unlock(&aggregate_mutex);
+	return err;
+}
+
+static int pcm_ioctl(struct snd_pcm_substream *substream, unsigned int cmd,
+	void *arg)
+{
+	switch (cmd) {
+	case SNDRV_PCM_IOCTL1_CHANNEL_INFO:
+		return generic_dma_channel_offset(substream, arg,
+			SNDRV_PCM_FMTBIT_S32_LE, 0);
+	default:
+		break;
+	}
+
+	return generic_pcm_ioctl(substream, cmd, arg);
+}
+
+static int pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	int const stream = substream->stream;
+	struct aggregate_member *m = NULL;
+	struct aggregate_member *failed = NULL;
+	bool armed = false;
+	int err = 0;
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		for_each_member(m) {
+			if (!m->configured[stream])
+				continue;
+			err = clara_e_dir_start(m->chip, substream, &armed);
+			if (err < 0) {
+				failed = m;
+				break;
+			}
+		}
+		if (failed) {
+			// stop the cards started so far
+			for_each_member(m) {
+				if (m == failed)
+					break;
+				if (m->configured[stream])
+					clara_e_dir_stop(m->chip, substream);
+			}
+			return err;
+		}
+		if (!armed)
+			break;
+		for_each_member(m) {
+			if (m->configured[stream])
+				clara_e_engine_release(m->chip);
+		}
+		break;
+	case SNDRV_PCM_TRIGGER_STOP:
+		for_each_member(m) {
+			if (m->configured[stream])
+				clara_e_dir_stop(m->chip, substream);
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static snd_pcm_uframes_t pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct generic_chip *first = NULL;
+	snd_pcm_uframes_t pos = 0;
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&aggregate_lock, irq_flags);
+	first = aggregate.members[0].chip;
+	if (first != NULL)
+		pos = clara_pointer(first, substream);
+	spin_unlock_irqrestore(&aggregate_lock, irq_flags);
+	return pos;
+}
+
+static struct snd_pcm_ops const aggregate_ops = {
+	.open = pcm_open,
+	.close = pcm_close,
+	.ioctl = pcm_ioctl,
+	.hw_params = pcm_hw_params,
+	.hw_free = pcm_hw_free,
+	.prepare = pcm_prepare,
+	.trigger = pcm_trigger,
+	.pointer = pcm_pointer,
+	PCM_COPY_OPS,
+};
+
+/* The card takes the slot given by its position among the enabled cards, so
+ * the order of the channels and the card hosting the PCM do not depend on
+ * the order the cards are probed in. The card in position 0 hosts the PCM,
+ * the others wait for it if they come first. */
+int clara_aggregate_join(struct generic_chip *chip, unsigned int position)
+{
+	struct aggregate_member *m = NULL;
+	int err = 0;
+
+	if (position >= CLARA_AGGREGATE_MAX_CARDS) {
+		PRINT_WARN("aggregate: more than %d cards, %s is not added\n",
+			CLARA_AGGREGATE_MAX_CARDS, chip->card->shortname);
+		return 0;
+	}
+	mutex_lock(&aggregate_mutex);
+	m = &aggregate.members[position];
+	if (m->chip != NULL) {
+		PRINT_WARN("aggregate: position %d is taken, %s is not "
+			"added\n", position, chip->card->shortname);
+		goto unlock;
+	}
+	if (position == 0) {
+		struct snd_pcm *pcm = NULL;
+		err = snd_pcm_new(chip->card, "Aggregate",
+			CLARA_AGGREGATE_PCM_DEVICE, 1, 1, &pcm);
+		if (err < 0)
+			goto unlock;
+		pcm->private_data = &aggregate;
+		sprintf(pcm->name, "MARIAN Aggregate PCM");
+		snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK,
+			&aggregate_ops);
+		snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE,
+			&aggregate_ops);
+		aggregate.pcm = pcm;
+	}
+	spin_lock_irq(&aggregate_lock);
+	memset(m, 0, sizeof(*m));
+	m->chip = chip;
+	spin_unlock_irq(&aggregate_lock);
+	PRINT_INFO("aggregate: added %s as card %d\n", chip->card->shortname,
+		position);
+unlock:
+	mutex_unlock(&aggregate_mutex);
+	return err;
+}
+
+/* A card that is part of an open aggregate substream cannot just vanish,
+ * the substream is disconnected. If the card hosting the PCM leaves, the
+ * aggregate is dissolved, the other cards keep their slots until a card
+ * in position 0 comes back. */
+void clara_aggregate_leave(struct generic_chip *chip)
+{
+	struct aggregate_member *leaving = NULL;
+	struct aggregate_member *m = NULL;
+	bool dissolve = false;
+	int stream = 0;
+
+	mutex_lock(&aggregate_mutex);
+	dissolve = (aggregate.members[0].chip == chip);
+	for_each_member(m)
+		if (m->chip == chip)
+			leaving = m;
+	if (leaving == NULL)
+		goto unlock;
+
+	for (stream = 0; stream < 2; stream++) {
+		struct snd_pcm_substream *substream =
+			aggregate.substreams[stream];
+		if (substream == NULL ||
+			(!dissolve && !leaving->claimed[stream]))
+			continue;
+		snd_pcm_stream_lock_irq(substream);
+		snd_pcm_stop(substream, SNDRV_PCM_STATE_DISCONNECTED);
+		snd_pcm_stream_unlock_irq(substream);
+		for_each_member(m) {
+			if (!dissolve && m != leaving)
+				continue;
+			release_member(m, substream);
+			unclaim_member(m, stream);
+		}
+	}
+	spin_lock_irq(&aggregate_lock);
+	leaving->chip = NULL;
+	if (dissolve)
+		aggregate.pcm = NULL;
+	spin_unlock_irq(&aggregate_lock);
+	if (dissolve)
+		PRINT_INFO("aggregate: dissolved\n");
+unlock:
+	mutex_unlock(&aggregate_mutex);
+}
+
+/* Stops the aggregate substreams the card takes part in, its sample rate no
+ * longer matches the one they were opened with. */
+void clara_aggregate_rate_changed(struct generic_chip *chip)
+{
+	struct aggregate_member *m = NULL;
+	int stream = 0;
+
+	mutex_lock(&aggregate_mutex);
+	for_each_member(m) {
+		if (m->chip != chip)
+			continue;
+		for (stream = 0; stream < 2; stream++) {
+			if (m->claimed[stream] &&
+				aggregate.substreams[stream] != NULL)
+				snd_pcm_stop_xrun(aggregate.substreams[stream]);
+		}
+	}
+	mutex_unlock(&aggregate_mutex);
+}
@@ -0,0 +1,34 @@
+/*
+ * MARIAN PCIe soundcards ALSA driver
+ *
+ * Author: Tobias Groß <theguy@audio-fpga.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef MARIAN_CLARA_AGGREGATE_H
+#define MARIAN_CLARA_AGGREGATE_H
+
+#include "device_generic.h"
+
+#define CLARA_AGGREGATE_MAX_CARDS 8
+// PCM device number of the aggregate PCM on the first card
+#define CLARA_AGGREGATE_PCM_DEVICE 1
+
+/* The aggregate PCM covers the channels of all Clara cards that joined it,
+ * one card after the other by their position among the enabled cards. It is
+ * created on the card in position 0, before that card is registered. */
+int clara_aggregate_join(struct generic_chip *chip, unsigned int position);
+void clara_aggregate_leave(struct generic_chip *chip);
+void clara_aggregate_rate_changed(struct generic_chip *chip);
+
+#endif
@@ -27,6 +27,8 @@
 #include "device_generic.h"
 #include "clara.h"
 #include "clara_e.h"
+#include "clara_aggregate.h"
+#include "pcm_copy.h"
 #include "dma_ng.h"
 
 #define TIMER_INTERVAL_MS 1000
@@ -128,14 +130,19 @@ static int chip_new(struct snd_card *card,
 	chip->min_num_channels = 1;
 	chip->max_num_channels = 512;
 	clara_chip->max_num_dma_blocks = 128;
-	clara_chip->channels_per_dma_slice = 512;
+	clara_chip->max_channels_per_dma_slice = 512;
 	// caps are the same for playback and capture
 	chip->hw_caps_playback = (struct snd_pcm_hardware const) {
 		.info = (SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_NONINTERLEAVED |
+			SNDRV_PCM_INFO_INTERLEAVED |
 			SNDRV_PCM_INFO_JOINT_DUPLEX |
 			SNDRV_PCM_INFO_SYNC_START |
-			SNDRV_PCM_INFO_BLOCK_TRANSFER),
-		.formats = SNDRV_PCM_FMTBIT_S32_LE,
+			SNDRV_PCM_INFO_BLOCK_TRANSFER |
+			SNDRV_PCM_INFO_NO_PERIOD_WAKEUP |
+			SNDRV_PCM_INFO_HAS_LINK_ATIME |
+			SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME),
+		.formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S16_LE |
+			SNDRV_PCM_FMTBIT_S24_3LE | SNDRV_PCM_FMTBIT_FLOAT_LE,
 		.rates = (SNDRV_PCM_RATE_44100 | SNDRV_PCM_RATE_48000 |
 			SNDRV_PCM_RATE_88200 | SNDRV_PCM_RATE_96000 |
 			SNDRV_PCM_RATE_176400 | SNDRV_PCM_RATE_192000),
@@ -145,14 +152,14 @@ static int chip_new(struct snd_card *card,
 		.channels_max = chip->max_num_channels,
 		.buffer_bytes_max = DMA_BLOCK_SIZE_BYTES *
 			clara_chip->max_num_dma_blocks *
-			DMA_NUM_PERIODS * chip->max_num_channels,
+			chip->max_num_channels,
 		.period_bytes_min = DMA_BLOCK_SIZE_BYTES *
 			chip->min_num_channels,
 		.period_bytes_max = DMA_BLOCK_SIZE_BYTES *
 			clara_chip->max_num_dma_blocks *
-			chip->max_num_channels,
-		.periods_min = DMA_NUM_PERIODS,
-		.periods_max = DMA_NUM_PERIODS,
+			chip->max_num_channels / DMA_MIN_NUM_PERIODS,
+		.periods_min = DMA_MIN_NUM_PERIODS,
+		.periods_max = DMA_MAX_NUM_PERIODS,
 		.fifo_size = 0,
 	};
 
@@ -184,17 +191,180 @@ void clara_e_register_device_specifics(struct device_specifics *dev_specifics)
 	dev_specifics->alloc_dma_buffers = clara_alloc_dma_buffers;
 	dev_specifics->measure_wordclock_hz = generic_measure_wordclock_hz;
 	dev_specifics->irq_handler = dma_ng_irq_handler;
+	dev_specifics->irq_thread_handler = dma_ng_irq_thread_handler;
 	dev_specifics->pcm_playback_ops = &playback_ops;
 	dev_specifics->pcm_capture_ops = &capture_ops;
 	dev_specifics->timer_callback = timer_callback;
+	dev_specifics->sample_rate_changed = clara_e_sample_rate_changed;
+	dev_specifics->get_clock_mode = clara_e_get_clock_mode;
 	dev_specifics->timer_interval_ms = TIMER_INTERVAL_MS;
 	dev_specifics->create_controls = create_controls;
+	dev_specifics->join_aggregate = clara_aggregate_join;
+	dev_specifics->leave_aggregate = clara_aggregate_leave;
 }
 
 /*
 	PCM FUNCTIONS
 */
 
+/* Returns whether the block ring is used by anything else than the given
+ * substream, i.e. the other direction or another subdevice.
+ * The caller needs to make sure that this runs in a critical section. */
+static bool ring_shared(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_substream **substreams =
+		generic_substreams(chip, substream->stream);
+	unsigned int i = 0;
+
+	if (generic_configured(chip,
+		(substream->stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		SNDRV_PCM_STREAM_CAPTURE : SNDRV_PCM_STREAM_PLAYBACK))
+		return true;
+	for (i = 0; i < chip->num_subdevices; i++)
+		if (substreams[i] != NULL && i != substream->number)
+			return true;
+	return false;
+}
+
+/* Returns the period size of the other configured subdevices of the same
+ * direction or 0 if there are none.
+ * The caller needs to make sure that this runs in a critical section. */
+static unsigned int sibling_period_frames(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_substream **substreams =
+		generic_substreams(chip, substream->stream);
+	unsigned int i = 0;
+
+	for (i = 0; i < chip->num_subdevices; i++)
+		if (substreams[i] != NULL && i != substream->number)
+			return substreams[i]->runtime->period_size;
+	return 0;
+}
+
+/* Clears the part of the DMA buffer that was used since it was cleared last,
+ * which is far less than the whole buffer unless all channels and the
+ * largest buffer size were in use. A buffer that is about to be freed only
+ * needs the bookkeeping to be reset. */
+static void clear_used_buffer(struct generic_chip *chip, int stream,
+	bool clear)
+{
+	struct snd_dma_buffer *buf = generic_dma_buffer(chip, stream);
+	size_t bytes = 0;
+	__maybe_unused unsigned long irq_flags;
+
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	bytes = generic_take_dma_buffer_used(chip, stream);
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	if (clear && buf->area != NULL && bytes > 0) {
+		memset(buf->area, 0, min(bytes, buf->bytes));
+		generic_sync_dma_buffer(buf);
+	}
+}
+
+// channels of the card in the current clock mode, 0 if there is none
+static unsigned int mode_channels(struct generic_chip *chip)
+{
+	struct clara_chip *clara_chip = chip->specific;
+	struct clara_e_chip *clara_e_chip = clara_chip->specific;
+	enum clock_mode const cmode = generic_sample_rate_to_clock_mode(
+		atomic_read(&chip->current_sample_rate));
+
+	if (cmode > CLOCK_MODE_192)
+		return 0;
+	return clara_e_chip->max_channels[cmode];
+}
+
+/* With several subdevices each one is bound to its channel range, which has
+ * to fit the clock mode. The mode may change from open to prepare. */
+static int check_channel_range(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
+{
+	unsigned int const max_channels = mode_channels(chip);
+	struct generic_channel_range range;
+	__maybe_unused unsigned long irq_flags;
+
+	if (chip->num_subdevices <= 1)
+		return 0;
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	range = *generic_channel_range(chip, substream->stream,
+		substream->number);
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	if (range.count == 0 || range.first + range.count > max_channels) {
+		PRINT_ERROR("channel range of subdevice %d exceeds %d "
+			"channels\n", substream->number, max_channels);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Number of channels the buffer of the direction holds, which are the
+ * channels of all ranges with several subdevices. */
+static unsigned int buffer_channels(struct generic_chip *chip, int stream,
+	unsigned int channels)
+{
+	DECLARE_BITMAP(channel_enables, GENERIC_MAX_NUM_CHANNELS);
+	__maybe_unused unsigned long irq_flags;
+
+	if (chip->num_subdevices <= 1)
+		return channels;
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	generic_get_channel_enables(chip, stream, 0, mode_channels(chip),
+		channel_enables);
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	return bitmap_weight(channel_enables, GENERIC_MAX_NUM_CHANNELS);
+}
+
+/* Subdevices share the buffer of the direction. The first one to be
+ * configured allocates it with the size of the configuration, the others
+ * find it in place. The caller needs to hold buffer_mutex. */
+static int attach_buffer(struct generic_chip *chip,
+	struct snd_pcm_substream *substream, size_t bytes)
+{
+	struct snd_dma_buffer *buf =
+		generic_dma_buffer(chip, substream->stream);
+	bool shared = false;
+	int err = 0;
+	__maybe_unused unsigned long irq_flags;
+
+	if (buf->area == NULL || buf->bytes < bytes) {
+		LOCK_ACQUIRE(&chip->lock, irq_flags);
+		shared = sibling_period_frames(chip, substream) > 0;
+		LOCK_RELEASE(&chip->lock, irq_flags);
+		if (shared)
+			return -EBUSY;
+		clear_used_buffer(chip, substream->stream,
+			generic_dma_buffer_preallocated(chip,
+				substream->stream));
+		err = generic_alloc_dma_buffer(chip, substream->stream, bytes);
+		if (err < 0)
+			return err;
+	}
+	snd_pcm_set_runtime_buffer(substream, buf);
+	return 0;
+}
+
+/* Releases the buffer once the last subdevice of the direction is gone.
+ * The preallocated buffer is cleared for the next user, a freshly allocated
+ * one is zeroed anyway. The caller needs to hold buffer_mutex. */
+static void detach_buffer(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
+{
+	bool configured = false;
+	__maybe_unused unsigned long irq_flags;
+
+	snd_pcm_set_runtime_buffer(substream, NULL);
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	configured = generic_configured(chip, substream->stream);
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	if (configured)
+		return;
+	clear_used_buffer(chip, substream->stream,
+		generic_dma_buffer_preallocated(chip, substream->stream));
+	generic_release_dma_buffer(chip, substream->stream);
+}
+
 int clara_e_pcm_open(struct snd_pcm_substream *substream)
 {
 	struct generic_chip *chip = snd_pcm_substream_chip(substream);
@@ -205,16 +375,34 @@ int clara_e_pcm_open(struct snd_pcm_substream *substream)
 		atomic_read(&chip->current_sample_rate);
 	enum clock_mode const cmode =
 		generic_sample_rate_to_clock_mode(current_rate);
+	unsigned int first_channel = 0;
 	if (cmode > CLOCK_MODE_192) {
 		PRINT_ERROR("pcm_open: invalid clock mode: %d\n", cmode);
 		return -EINVAL;
 	}
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	if ((substream->stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		chip->playback_aggregated : chip->capture_aggregated) {
+		LOCK_RELEASE(&chip->lock, irq_flags);
+		PRINT_ERROR("pcm_open: in use by the aggregate PCM\n");
+		return -EBUSY;
+	}
+	LOCK_RELEASE(&chip->lock, irq_flags);
 	snd_pcm_set_sync(substream);
 	snd_pcm_hw_constraint_list(substream->runtime, 0,
 		SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
 		&(clara_e_chip->hw_constraints_period_sizes[cmode]));
+	// every page of the DMA ring has to hold the same number of periods
+	snd_pcm_hw_constraint_step(substream->runtime, 0,
+		SNDRV_PCM_HW_PARAM_PERIODS, DMA_NUM_PAGES);
+	snd_pcm_hw_constraint_minmax(substream->runtime,
+		SNDRV_PCM_HW_PARAM_BUFFER_SIZE, 0,
+		DMA_MAX_NUM_BLOCKS * DMA_SAMPLES_PER_BLOCK);
 	// caps are the same for playback and capture
 	substream->runtime->hw = chip->hw_caps_playback;
+	// a non-coherent buffer is synced by the PCM core on pointer updates
+	substream->runtime->hw.info |= generic_dma_info(chip,
+		substream->stream);
 
 	// since Dante is the clock master, the sample rate is fixed
 	substream->runtime->hw.rate_min = current_rate;
@@ -223,22 +411,103 @@ int clara_e_pcm_open(struct snd_pcm_substream *substream)
 	substream->runtime->hw.channels_max =
 		clara_e_chip->max_channels[cmode];
 
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
-		PRINT_DEBUG("pcm_playback_open\n");
-		generic_clear_dma_buffer(&chip->playback_buf);
+	if (chip->num_subdevices > 1) {
+		// each subdevice is bound to its channel range
+		struct generic_channel_range range;
+		int err = check_channel_range(chip, substream);
+		if (err < 0)
+			return err;
 		LOCK_ACQUIRE(&chip->lock, irq_flags);
-		snd_pcm_set_runtime_buffer(substream, &chip->playback_buf);
-		chip->playback_substream = substream;
+		range = *generic_channel_range(chip, substream->stream,
+			substream->number);
 		LOCK_RELEASE(&chip->lock, irq_flags);
-	} else {
-		PRINT_DEBUG("pcm_capture_open\n");
-		generic_clear_dma_buffer(&chip->capture_buf);
+		substream->runtime->hw.channels_min = range.count;
+		substream->runtime->hw.channels_max = range.count;
+	} else {	// a channel selection fixes the number of channels
+		unsigned long *selection =
+			generic_channel_selection(chip, substream->stream);
+		unsigned int selected = 0;
 		LOCK_ACQUIRE(&chip->lock, irq_flags);
-		snd_pcm_set_runtime_buffer(substream, &chip->capture_buf);
-		chip->capture_substream = substream;
+		selected = bitmap_weight(selection, GENERIC_MAX_NUM_CHANNELS);
+		if (selected > 0 && find_last_bit(selection,
+			GENERIC_MAX_NUM_CHANNELS) >=
+			clara_e_chip->max_channels[cmode]) {
+			LOCK_RELEASE(&chip->lock, irq_flags);
+			PRINT_ERROR("pcm_open: channel selection exceeds "
+				"%d channels\n",
+				clara_e_chip->max_channels[cmode]);
+			return -EINVAL;
+		}
 		LOCK_RELEASE(&chip->lock, irq_flags);
+		if (selected > 0) {
+			substream->runtime->hw.channels_min = selected;
+			substream->runtime->hw.channels_max = selected;
+		}
 	}
-	return 0;
+
+	{	// the block ring is shared, so a direction opened while the
+		// other one is configured has to use its buffer size, the
+		// period size can still be chosen freely. Subdevices of the
+		// same direction share the period layout as well.
+		unsigned int num_buffer_frames = 0;
+		unsigned int period_frames = 0;
+		LOCK_ACQUIRE(&chip->lock, irq_flags);
+		if (ring_shared(chip, substream))
+			num_buffer_frames = chip->num_buffer_frames;
+		period_frames = sibling_period_frames(chip, substream);
+		LOCK_RELEASE(&chip->lock, irq_flags);
+		if (num_buffer_frames > 0)
+			snd_pcm_hw_constraint_minmax(substream->runtime,
+				SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+				num_buffer_frames, num_buffer_frames);
+		if (period_frames > 0)
+			snd_pcm_hw_constraint_minmax(substream->runtime,
+				SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+				period_frames, period_frames);
+	}
+
+	// the buffer is attached in hw_params
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		PRINT_DEBUG("pcm_playback_open\n");
+	else
+		PRINT_DEBUG("pcm_capture_open\n");
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	first_channel = generic_channel_position(chip, substream->stream,
+		substream->number, mode_channels(chip));
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	return pcm_copy_open(substream, first_channel);
+}
+
+/* Number of channels a direction transfers if the whole card is used, which
+ * is the channel selection if there is one, or all channel ranges with
+ * several subdevices. Returns 0 if the selection does not fit the clock
+ * mode. */
+unsigned int clara_e_num_channels(struct generic_chip *chip, int stream,
+	enum clock_mode cmode)
+{
+	struct clara_chip *clara_chip = chip->specific;
+	struct clara_e_chip *clara_e_chip = clara_chip->specific;
+	unsigned long *selection = generic_channel_selection(chip, stream);
+	unsigned int channels = clara_e_chip->max_channels[cmode];
+	__maybe_unused unsigned long irq_flags;
+
+	DECLARE_BITMAP(channel_enables, GENERIC_MAX_NUM_CHANNELS);
+
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	if (chip->num_subdevices > 1) {
+		// all channel ranges
+		generic_get_channel_enables(chip, stream, 0,
+			clara_e_chip->max_channels[cmode], channel_enables);
+		selection = channel_enables;
+	}
+	if (!bitmap_empty(selection, GENERIC_MAX_NUM_CHANNELS)) {
+		channels = bitmap_weight(selection, GENERIC_MAX_NUM_CHANNELS);
+		if (find_last_bit(selection, GENERIC_MAX_NUM_CHANNELS) >=
+			clara_e_chip->max_channels[cmode])
+			channels = 0;
+	}
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	return channels;
 }
 
 int clara_e_pcm_close(struct snd_pcm_substream *substream)
@@ -248,105 +517,113 @@ int clara_e_pcm_close(struct snd_pcm_substream *substream)
 	return 0;
 }
 
-int clara_e_pcm_hw_params(struct snd_pcm_substream *substream,
-	struct snd_pcm_hw_params *hw_params)
+/* Direction level operations on a single card. They are shared by the PCM
+ * callbacks below and the aggregate PCM spanning several cards, where the
+ * substream belongs to the PCM of another card. */
+
+int clara_e_dir_hw_params(struct generic_chip *chip,
+	struct snd_pcm_substream *substream, unsigned int rate,
+	unsigned int num_frames)
 {
-	struct generic_chip *chip = snd_pcm_substream_chip(substream);
 	__maybe_unused unsigned long irq_flags;
 
-	PRINT_DEBUG("pcm_hw_params\n");
-	PRINT_DEBUG("  sample rate: %d\n",
-		params_rate(hw_params));
-	PRINT_DEBUG("  buffer bytes: %d\n",
-		params_buffer_bytes(hw_params));
-	PRINT_DEBUG("  buffer size : %d\n",
-		params_buffer_size(hw_params));
-	PRINT_DEBUG("  period bytes: %d\n",
-		params_period_bytes(hw_params));
-	PRINT_DEBUG("  period size : %d\n",
-		params_period_size(hw_params));
-	PRINT_DEBUG("  periods     : %d\n",
-		params_periods(hw_params));
-	PRINT_DEBUG("  channels    : %d\n",
-		params_channels(hw_params));
-
 	LOCK_ACQUIRE(&chip->lock, irq_flags);
 	{	// this is certainly CLARA E specific
 		// other cards could adapt if not synced externally
 		unsigned int current_rate =
 			atomic_read(&chip->current_sample_rate);
-		if (params_rate(hw_params) != current_rate) {
+		if (rate != current_rate) {
 			LOCK_RELEASE(&chip->lock, irq_flags);
 			PRINT_ERROR(
 				"pcm_hw_params: sample rate mismatch. "
 				"requested: %d, current: %d\n",
-				substream->runtime->rate, current_rate);
+				rate, current_rate);
 			return -EINVAL;
 		}
 	}
 
 	{
-		// this is in number of samples per channel
-		int num_frames = params_buffer_size(hw_params);
-		if (chip->num_buffer_frames != 0 &&
+		// both directions and all subdevices share the same block ring
+		// and therefore the same buffer size, unless nothing else is
+		// configured. The FPGA has a single block count register, so a
+		// direction can only be reconfigured with the buffer size of
+		// the running one. The number of periods is up to each
+		// direction.
+		if (ring_shared(chip, substream) &&
 			chip->num_buffer_frames != num_frames) {
 			LOCK_RELEASE(&chip->lock, irq_flags);
 			PRINT_ERROR("pcm_hw_params: "
 				"buffer size changed from %d to %d\n",
 				chip->num_buffer_frames, num_frames);
 			return -EBUSY;
-
 		}
 		chip->num_buffer_frames = num_frames;
 	}
+	generic_substreams(chip, substream->stream)[substream->number] =
+		substream;
 	LOCK_RELEASE(&chip->lock, irq_flags);
 	return 0;
 }
 
-int clara_e_pcm_hw_free(struct snd_pcm_substream *substream)
+void clara_e_dir_hw_free(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
 {
-	struct generic_chip *chip = snd_pcm_substream_chip(substream);
+	bool const playback = (substream->stream == SNDRV_PCM_STREAM_PLAYBACK);
 	__maybe_unused unsigned long irq_flags;
 
 	LOCK_ACQUIRE(&chip->lock, irq_flags);
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
-		chip->playback_substream = NULL;
-	else
-		chip->capture_substream = NULL;
-	if (chip->playback_substream == NULL &&
-		chip->capture_substream == NULL) {
+	generic_substreams(chip, substream->stream)[substream->number] = NULL;
+	if (playback) {
+		__clear_bit(substream->number, &chip->playback_running);
+		__clear_bit(substream->number,
+			&chip->playback_no_period_wakeup);
+	} else {
+		__clear_bit(substream->number, &chip->capture_running);
+		__clear_bit(substream->number,
+			&chip->capture_no_period_wakeup);
+	}
+	// the other direction or other subdevices may keep running, but
+	// otherwise the engine must not touch this buffer anymore
+	if (!(playback ? chip->playback_running : chip->capture_running))
+		dma_ng_disable_channels(chip, playback);
+	if (!generic_configured(chip, SNDRV_PCM_STREAM_PLAYBACK) &&
+		!generic_configured(chip, SNDRV_PCM_STREAM_CAPTURE)) {
 		dma_ng_stop(chip);
 		dma_ng_disable_interrupts(chip);
 		chip->num_buffer_frames = 0;
+	} else {
+		// the remaining substream might not need period IRQs
+		dma_ng_update_interrupts(chip);
 	}
 	LOCK_RELEASE(&chip->lock, irq_flags);
-	return 0;
+	// make sure the period timer does not touch the substream anymore
+	dma_ng_sync_period_ticks(chip);
 }
 
-int clara_e_pcm_prepare(struct snd_pcm_substream *substream)
+/* Programs the DMA engine for the first channels of the card (or its channel
+ * selection). Without period_wakeup the card does not raise period IRQs for
+ * this direction. */
+int clara_e_dir_prepare(struct generic_chip *chip,
+	struct snd_pcm_substream *substream, u64 base_addr,
+	unsigned int channels, bool period_wakeup)
 {
-	struct generic_chip *chip = snd_pcm_substream_chip(substream);
 	struct clara_chip *clara_chip = chip->specific;
-	u64 base_addr = substream->runtime->dma_addr;
-	unsigned int channels = substream->runtime->channels;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	DECLARE_BITMAP(channel_enables, GENERIC_MAX_NUM_CHANNELS);
+	unsigned long *running = NULL;
 	unsigned int no_blocks = 0;
+	unsigned int period_frames = 0;
 	int err = 0;
 	__maybe_unused unsigned long irq_flags;
 
-	PRINT_DEBUG("pcm_prepare\n");
-
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
-		PRINT_DEBUG("pcm_prepare: playback base: %p\n",
-			(void *)base_addr);
-	}
-	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
-		PRINT_DEBUG("pcm_prepare: capture base: %p\n",
-			(void *)base_addr);
+	if (runtime->rate != atomic_read(&chip->current_sample_rate)) {
+		PRINT_ERROR("pcm_prepare: sample rate changed to %d\n",
+			atomic_read(&chip->current_sample_rate));
+		return -EINVAL;
 	}
-
 	LOCK_ACQUIRE(&chip->lock, irq_flags);
-	no_blocks = substream->runtime->period_size /
-		DMA_SAMPLES_PER_BLOCK * DMA_NUM_PERIODS;
+	no_blocks = runtime->period_size / DMA_SAMPLES_PER_BLOCK *
+		runtime->periods;
 	if (chip->num_buffer_frames != no_blocks * DMA_SAMPLES_PER_BLOCK) {
 		LOCK_RELEASE(&chip->lock, irq_flags);
 		PRINT_ERROR("pcm_prepare: "
@@ -355,21 +632,256 @@ int clara_e_pcm_prepare(struct snd_pcm_substream *substream)
 			no_blocks * DMA_SAMPLES_PER_BLOCK);
 		return -EBUSY;
 	}
-	err = dma_ng_prepare(chip, channels,
+	period_frames = sibling_period_frames(chip, substream);
+	if (period_frames > 0 && period_frames != runtime->period_size) {
+		LOCK_RELEASE(&chip->lock, irq_flags);
+		PRINT_ERROR("pcm_prepare: "
+			"period size differs from other subdevices\n");
+		return -EBUSY;
+	}
+	running = (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		&chip->playback_running : &chip->capture_running;
+	__assign_bit(substream->number,
+		(substream->stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		&chip->playback_no_period_wakeup :
+		&chip->capture_no_period_wakeup, !period_wakeup);
+	if (*running & ~BIT(substream->number)) {
+		// other subdevices keep the direction running with the same
+		// buffer and channel layout
+		dma_ng_update_interrupts(chip);
+		LOCK_RELEASE(&chip->lock, irq_flags);
+		return 0;
+	}
+	generic_get_channel_enables(chip, substream->stream, channels,
+		mode_channels(chip), channel_enables);
+	err = dma_ng_prepare(chip, channel_enables,
 		(substream->stream == SNDRV_PCM_STREAM_PLAYBACK),
-		base_addr, no_blocks, clara_chip->channels_per_dma_slice);
+		base_addr, no_blocks, runtime->periods,
+		clara_chip->max_channels_per_dma_slice);
 	LOCK_RELEASE(&chip->lock, irq_flags);
 	PRINT_DEBUG("pcm_prepare: no_blocks: %d\n", no_blocks);
 	return err;
 }
 
+/* Enables the channels of a direction that is about to start and arms the
+ * engine of the card if it is not running yet. Sets rarmed if the engine has
+ * been armed and still needs to be released by clara_e_engine_release(). */
+int clara_e_dir_start(struct generic_chip *chip,
+	struct snd_pcm_substream *substream, bool *rarmed)
+{
+	bool const playback = (substream->stream == SNDRV_PCM_STREAM_PLAYBACK);
+	int err = 0;
+	__maybe_unused unsigned long irq_flags;
+
+	PRINT_DEBUG("pcm_trigger: start %s\n", playback ?
+		"playback" : "capture");
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	// the channels stay disabled if the direction was prepared while the
+	// engine was running for the other one
+	dma_ng_enable_channels(chip, playback);
+	if (chip->dma_status == DMA_STATUS_RUNNING) {
+		// joining a running engine, link time starts now
+		u64 frames = generic_update_frame_count(chip,
+			generic_get_sample_counter(chip));
+		if (playback)
+			chip->playback_start_frames[substream->number] = frames;
+		else
+			chip->capture_start_frames[substream->number] = frames;
+	} else if (chip->dma_status != DMA_STATUS_PREPARED) {
+		err = dma_ng_arm(chip);
+		if (err < 0) {
+			if (!(playback ? chip->playback_running :
+				chip->capture_running))
+				dma_ng_disable_channels(chip, playback);
+			LOCK_RELEASE(&chip->lock, irq_flags);
+			PRINT_ERROR("pcm_trigger: could not arm the engine\n");
+			return err;
+		}
+		*rarmed = true;
+	}
+	if (playback)
+		__set_bit(substream->number, &chip->playback_running);
+	else
+		__set_bit(substream->number, &chip->capture_running);
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	return 0;
+}
+
+void clara_e_engine_release(struct generic_chip *chip)
+{
+	__maybe_unused unsigned long irq_flags;
+
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	if (chip->dma_status == DMA_STATUS_PREPARED)
+		dma_ng_release(chip);
+	LOCK_RELEASE(&chip->lock, irq_flags);
+}
+
+/* The channels of the direction stay enabled as long as another subdevice
+ * is running, the engine as long as anything is running. */
+void clara_e_dir_stop(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
+{
+	__maybe_unused unsigned long irq_flags;
+
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		PRINT_DEBUG("pcm_trigger: stop capture\n");
+		__clear_bit(substream->number, &chip->capture_running);
+		if (!chip->capture_running) {
+			if (!chip->playback_running) {
+				dma_ng_stop(chip);
+			}
+			dma_ng_disable_channels(chip, false);
+		}
+	} else {
+		PRINT_DEBUG("pcm_trigger: stop playback\n");
+		__clear_bit(substream->number, &chip->playback_running);
+		if (!chip->playback_running) {
+			dma_ng_disable_channels(chip, true);
+			if (!chip->capture_running) {
+				dma_ng_stop(chip);
+			}
+		}
+	}
+	LOCK_RELEASE(&chip->lock, irq_flags);
+}
+
+int clara_e_pcm_hw_params(struct snd_pcm_substream *substream,
+	struct snd_pcm_hw_params *hw_params)
+{
+	struct generic_chip *chip = snd_pcm_substream_chip(substream);
+	unsigned int first_channel = 0;
+	__maybe_unused unsigned long irq_flags;
+	int err = 0;
+
+	PRINT_DEBUG("pcm_hw_params\n");
+	PRINT_DEBUG("  sample rate: %d\n",
+		params_rate(hw_params));
+	PRINT_DEBUG("  buffer bytes: %d\n",
+		params_buffer_bytes(hw_params));
+	PRINT_DEBUG("  buffer size : %d\n",
+		params_buffer_size(hw_params));
+	PRINT_DEBUG("  period bytes: %d\n",
+		params_period_bytes(hw_params));
+	PRINT_DEBUG("  period size : %d\n",
+		params_period_size(hw_params));
+	PRINT_DEBUG("  periods     : %d\n",
+		params_periods(hw_params));
+	PRINT_DEBUG("  channels    : %d\n",
+		params_channels(hw_params));
+
+	err = check_channel_range(chip, substream);
+	if (err < 0)
+		return err;
+	// buffer size is in number of samples per channel
+	mutex_lock(&chip->buffer_mutex);
+	err = clara_e_dir_hw_params(chip, substream, params_rate(hw_params),
+		params_buffer_size(hw_params));
+	if (err < 0)
+		goto unlock;
+	// the buffer holds 32 bit samples whatever the format of the
+	// application is
+	err = attach_buffer(chip, substream,
+		(size_t)buffer_channels(chip, substream->stream,
+			params_channels(hw_params)) *
+		params_buffer_size(hw_params) * sizeof(u32));
+	if (err < 0) {
+		clara_e_dir_hw_free(chip, substream);
+		detach_buffer(chip, substream);
+		goto unlock;
+	}
+
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	first_channel = generic_channel_position(chip, substream->stream,
+		substream->number, mode_channels(chip));
+	generic_mark_dma_buffer_used(chip, substream->stream,
+		(size_t)(first_channel + params_channels(hw_params)) *
+		params_buffer_size(hw_params) * sizeof(u32));
+	LOCK_RELEASE(&chip->lock, irq_flags);
+unlock:
+	mutex_unlock(&chip->buffer_mutex);
+	return err;
+}
+
+int clara_e_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	struct generic_chip *chip = snd_pcm_substream_chip(substream);
+
+	mutex_lock(&chip->buffer_mutex);
+	clara_e_dir_hw_free(chip, substream);
+	detach_buffer(chip, substream);
+	mutex_unlock(&chip->buffer_mutex);
+	return 0;
+}
+
+/* Clears the playback channels of the substream, so a stale buffer is not
+ * played if the application starts before filling it. This runs in prepare,
+ * where it may take its time, rather than in the possibly atomic trigger;
+ * the channels are disabled on stop anyway. With several subdevices the
+ * buffer is shared, so the other channels must not be touched. */
+static void clear_buffer(struct generic_chip *chip,
+	struct snd_pcm_substream *substream)
+{
+	struct snd_dma_buffer *buf =
+		generic_dma_buffer(chip, substream->stream);
+	size_t const channel_bytes =
+		substream->runtime->buffer_size * sizeof(u32);
+	unsigned int first_channel = 0;
+	__maybe_unused unsigned long irq_flags;
+
+	LOCK_ACQUIRE(&chip->lock, irq_flags);
+	first_channel = generic_channel_position(chip, substream->stream,
+		substream->number, mode_channels(chip));
+	LOCK_RELEASE(&chip->lock, irq_flags);
+	memset(buf->area + first_channel * channel_bytes, 0,
+		substream->runtime->channels * channel_bytes);
+	generic_sync_dma_buffer(buf);
+}
+
+int clara_e_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct generic_chip *chip = snd_pcm_substream_chip(substream);
+	u64 base_addr = substream->runtime->dma_addr;
+	int err = 0;
+
+	PRINT_DEBUG("pcm_prepare\n");
+	err = check_channel_range(chip, substream);
+	if (err < 0)
+		return err;
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		PRINT_DEBUG("pcm_prepare: playback base: %p\n",
+			(void *)base_addr);
+		clear_buffer(chip, substream);
+	}
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		PRINT_DEBUG("pcm_prepare: capture base: %p\n",
+			(void *)base_addr);
+	}
+
+	// runtime->no_period_wakeup is only valid after hw_params
+	return clara_e_dir_prepare(chip, substream, base_addr,
+		substream->runtime->channels,
+		!substream->runtime->no_period_wakeup);
+}
+
 int clara_e_pcm_ioctl(struct snd_pcm_substream *substream,
 	unsigned int cmd, void *arg)
 {
+	struct generic_chip *chip = snd_pcm_substream_chip(substream);
+	unsigned int first_channel = 0;
+	__maybe_unused unsigned long irq_flags;
+
 	switch (cmd) {
 	case SNDRV_PCM_IOCTL1_CHANNEL_INFO:
+		LOCK_ACQUIRE(&chip->lock, irq_flags);
+		first_channel = generic_channel_position(chip,
+			substream->stream, substream->number,
+			mode_channels(chip));
+		LOCK_RELEASE(&chip->lock, irq_flags);
 		return generic_dma_channel_offset(substream, arg,
-			SNDRV_PCM_FMTBIT_S32_LE);
+			SNDRV_PCM_FMTBIT_S32_LE, first_channel);
 	default:
 		break;
 	}
@@ -377,41 +889,61 @@ int clara_e_pcm_ioctl(struct snd_pcm_substream *substream,
 	return generic_pcm_ioctl(substream, cmd, arg);
 }
 
+/* Starts all substreams linked to this one that belong to a MARIAN card,
+ * which may span several cards. All engines are armed first and then released
+ * back to back. The other substreams are marked as done, so ALSA does not
+ * trigger them again. If an engine cannot be armed, the substreams started so
+ * far are stopped again. The chip locks are taken one at a time, since the
+ * order of the cards within a group is arbitrary. */
+static int trigger_start(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_substream *s = NULL;
+	struct snd_pcm_substream *failed = NULL;
+	bool armed = false;
+	int err = 0;
+
+	snd_pcm_group_for_each_entry(s, substream) {
+		if (s->ops->trigger != clara_e_pcm_trigger)
+			continue;
+		err = clara_e_dir_start(snd_pcm_substream_chip(s), s, &armed);
+		if (err < 0) {
+			failed = s;
+			break;
+		}
+		snd_pcm_trigger_done(s, substream);
+	}
+	if (failed) {
+		snd_pcm_group_for_each_entry(s, substream) {
+			if (s == failed)
+				break;
+			if (s->ops->trigger == clara_e_pcm_trigger)
+				clara_e_dir_stop(snd_pcm_substream_chip(s), s);
+		}
+		return err;
+	}
+	if (!armed)
+		return 0;
+
+	// the trigger runs with the stream lock held, so nothing gets in
+	// between the releases
+	snd_pcm_group_for_each_entry(s, substream) {
+		if (s->ops->trigger != clara_e_pcm_trigger)
+			continue;
+		clara_e_engine_release(snd_pcm_substream_chip(s));
+	}
+	return 0;
+}
+
 int clara_e_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
 {
 	struct generic_chip *chip = snd_pcm_substream_chip(substream);
-	__maybe_unused unsigned long irq_flags;
 
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
-		PRINT_DEBUG("pcm_trigger: start %s\n",
-			substream->stream == SNDRV_PCM_STREAM_PLAYBACK ?
-			"playback" : "capture");
-		LOCK_ACQUIRE(&chip->lock, irq_flags);
-		if (chip->dma_status != DMA_STATUS_RUNNING)
-			dma_ng_start(snd_pcm_substream_chip(substream));
-		LOCK_RELEASE(&chip->lock, irq_flags);
-		break;
+		return trigger_start(substream);
 	case SNDRV_PCM_TRIGGER_STOP:
-		if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
-			PRINT_DEBUG("pcm_trigger: stop capture\n");
-			LOCK_ACQUIRE(&chip->lock, irq_flags);
-			if (chip->playback_substream == NULL) {
-				dma_ng_stop(chip);
-			}
-			LOCK_RELEASE(&chip->lock, irq_flags);
-			dma_ng_disable_channels(chip, false);
-			generic_clear_dma_buffer(&chip->capture_buf);
-		} else {
-			PRINT_DEBUG("pcm_trigger: stop playback\n");
-			generic_clear_dma_buffer(&chip->playback_buf);
-			dma_ng_disable_channels(chip, true);
-			LOCK_ACQUIRE(&chip->lock, irq_flags);
-			if (chip->capture_substream == NULL) {
-				dma_ng_stop(chip);
-			}
-			LOCK_RELEASE(&chip->lock, irq_flags);
-		}
+		// the playback buffer is cleared in the next prepare
+		clara_e_dir_stop(chip, substream);
 		break;
 	default:
 		return -EINVAL;
@@ -428,6 +960,8 @@ static struct snd_pcm_ops const playback_ops = {
 	.prepare = clara_e_pcm_prepare,
 	.trigger = clara_e_pcm_trigger,
 	.pointer = clara_pcm_pointer,
+	.get_time_info = clara_pcm_get_time_info,
+	PCM_COPY_OPS,
 };
 
 static struct snd_pcm_ops const capture_ops = {
@@ -439,6 +973,8 @@ static struct snd_pcm_ops const capture_ops = {
 	.prepare = clara_e_pcm_prepare,
 	.trigger = clara_e_pcm_trigger,
 	.pointer = clara_pcm_pointer,
+	.get_time_info = clara_pcm_get_time_info,
+	PCM_COPY_OPS,
 };
 
 static int create_controls(struct generic_chip *chip)
@@ -452,6 +988,41 @@ static int create_controls(struct generic_chip *chip)
 	else
 		atomic_set(&chip->ctl_id_sample_rate, ctl_id);
 
+	return clara_e_channel_controls_create(chip);
+}
+
+/* Either one channel selection per direction or, with several subdevices, one
+ * channel range per subdevice and direction. */
+int clara_e_channel_controls_create(struct generic_chip *chip)
+{
+	unsigned int i = 0;
+	int err = 0;
+
+	if (chip->num_subdevices > 1) {
+		for (i = 0; i < chip->num_subdevices; i++) {
+			err = generic_channel_range_control_create(chip,
+				"Playback Channel Range",
+				SNDRV_PCM_STREAM_PLAYBACK, i);
+			if (err < 0)
+				return err;
+			err = generic_channel_range_control_create(chip,
+				"Capture Channel Range",
+				SNDRV_PCM_STREAM_CAPTURE, i);
+			if (err < 0)
+				return err;
+		}
+		return 0;
+	}
+
+	err = generic_channel_selection_control_create(chip,
+		"Playback Channel Selection", SNDRV_PCM_STREAM_PLAYBACK);
+	if (err < 0)
+		return err;
+	err = generic_channel_selection_control_create(chip,
+		"Capture Channel Selection", SNDRV_PCM_STREAM_CAPTURE);
+	if (err < 0)
+		return err;
+
 	return 0;
 }
 
@@ -479,6 +1050,16 @@ enum clock_mode clara_e_get_clock_mode(struct generic_chip *chip)
 	return cmode;
 }
 
+/* Called by the rate monitor when the Dante network changed the sample rate.
+ * Running streams are stopped with an xrun, they have to be set up again
+ * with the new rate. */
+void clara_e_sample_rate_changed(struct generic_chip *chip)
+{
+	atomic_set(&chip->clock_mode, clara_e_get_clock_mode(chip));
+	generic_pcm_stop_xrun(chip->pcm);
+	clara_aggregate_rate_changed(chip);
+}
+
 static void timer_callback(struct generic_chip *chip)
 {
 	clara_timer_callback(chip);
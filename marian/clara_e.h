@@ -43,6 +43,23 @@ int clara_e_pcm_prepare(struct snd_pcm_substream *substream);
 int clara_e_pcm_ioctl(struct snd_pcm_substream *substream,
 	unsigned int cmd, void *arg);
 int clara_e_pcm_trigger(struct snd_pcm_substream *substream, int cmd);
+int clara_e_dir_hw_params(struct generic_chip *chip,
+	struct snd_pcm_substream *substream, unsigned int rate,
+	unsigned int num_frames);
+void clara_e_dir_hw_free(struct generic_chip *chip,
+	struct snd_pcm_substream *substream);
+int clara_e_dir_prepare(struct generic_chip *chip,
+	struct snd_pcm_substream *substream, u64 base_addr,
+	unsigned int channels, bool period_wakeup);
+int clara_e_dir_start(struct generic_chip *chip,
+	struct snd_pcm_substream *substream, bool *rarmed);
+void clara_e_engine_release(struct generic_chip *chip);
+void clara_e_dir_stop(struct generic_chip *chip,
+	struct snd_pcm_substream *substream);
+unsigned int clara_e_num_channels(struct generic_chip *chip, int stream,
+	enum clock_mode cmode);
+int clara_e_channel_controls_create(struct generic_chip *chip);
 enum clock_mode clara_e_get_clock_mode(struct generic_chip *chip);
+void clara_e_sample_rate_changed(struct generic_chip *chip);
 
 #endif
@@ -27,6 +27,8 @@
 #include "clara.h"
 #include "clara_e.h"
 #include "clara_emin.h"
+#include "clara_aggregate.h"
+#include "pcm_copy.h"
 #include "dma_ng.h"
 
 #define TIMER_INTERVAL_MS 1000
@@ -112,14 +114,19 @@ static int chip_new(struct snd_card *card,
 	chip->min_num_channels = 1;
 	chip->max_num_channels = 128;
 	clara_chip->max_num_dma_blocks = 128;
-	clara_chip->channels_per_dma_slice = 128;
+	clara_chip->max_channels_per_dma_slice = 128;
 	// caps are the same for playback and capture
 	chip->hw_caps_playback = (struct snd_pcm_hardware const) {
 		.info = (SNDRV_PCM_INFO_MMAP | SNDRV_PCM_INFO_NONINTERLEAVED |
+			SNDRV_PCM_INFO_INTERLEAVED |
 			SNDRV_PCM_INFO_JOINT_DUPLEX |
 			SNDRV_PCM_INFO_SYNC_START |
-			SNDRV_PCM_INFO_BLOCK_TRANSFER),
-		.formats = SNDRV_PCM_FMTBIT_S32_LE,
+			SNDRV_PCM_INFO_BLOCK_TRANSFER |
+			SNDRV_PCM_INFO_NO_PERIOD_WAKEUP |
+			SNDRV_PCM_INFO_HAS_LINK_ATIME |
+			SNDRV_PCM_INFO_HAS_LINK_ABSOLUTE_ATIME),
+		.formats = SNDRV_PCM_FMTBIT_S32_LE | SNDRV_PCM_FMTBIT_S16_LE |
+			SNDRV_PCM_FMTBIT_S24_3LE | SNDRV_PCM_FMTBIT_FLOAT_LE,
 		.rates = (SNDRV_PCM_RATE_44100 | SNDRV_PCM_RATE_48000 |
 			SNDRV_PCM_RATE_88200 | SNDRV_PCM_RATE_96000 |
 			SNDRV_PCM_RATE_176400 | SNDRV_PCM_RATE_192000),
@@ -129,14 +136,14 @@ static int chip_new(struct snd_card *card,
 		.channels_max = chip->max_num_channels,
 		.buffer_bytes_max = DMA_BLOCK_SIZE_BYTES *
 			clara_chip->max_num_dma_blocks *
-			DMA_NUM_PERIODS * chip->max_num_channels,
+			chip->max_num_channels,
 		.period_bytes_min = DMA_BLOCK_SIZE_BYTES *
 			chip->min_num_channels,
 		.period_bytes_max = DMA_BLOCK_SIZE_BYTES *
 			clara_chip->max_num_dma_blocks *
-			chip->max_num_channels,
-		.periods_min = DMA_NUM_PERIODS,
-		.periods_max = DMA_NUM_PERIODS,
+			chip->max_num_channels / DMA_MIN_NUM_PERIODS,
+		.periods_min = DMA_MIN_NUM_PERIODS,
+		.periods_max = DMA_MAX_NUM_PERIODS,
 		.fifo_size = 0,
 	};
 
@@ -169,11 +176,16 @@ void clara_emin_register_device_specifics(struct device_specifics
 	dev_specifics->alloc_dma_buffers = clara_alloc_dma_buffers;
 	dev_specifics->measure_wordclock_hz = generic_measure_wordclock_hz;
 	dev_specifics->irq_handler = dma_ng_irq_handler;
+	dev_specifics->irq_thread_handler = dma_ng_irq_thread_handler;
 	dev_specifics->pcm_playback_ops = &playback_ops;
 	dev_specifics->pcm_capture_ops = &capture_ops;
 	dev_specifics->timer_callback = timer_callback;
+	dev_specifics->sample_rate_changed = clara_e_sample_rate_changed;
+	dev_specifics->get_clock_mode = clara_e_get_clock_mode;
 	dev_specifics->timer_interval_ms = TIMER_INTERVAL_MS;
 	dev_specifics->create_controls = create_controls;
+	dev_specifics->join_aggregate = clara_aggregate_join;
+	dev_specifics->leave_aggregate = clara_aggregate_leave;
 }
 
 /*
@@ -188,6 +200,8 @@ static struct snd_pcm_ops const playback_ops = {
 	.prepare = clara_e_pcm_prepare,
 	.trigger = clara_e_pcm_trigger,
 	.pointer = clara_pcm_pointer,
+	.get_time_info = clara_pcm_get_time_info,
+	PCM_COPY_OPS,
 };
 
 static struct snd_pcm_ops const capture_ops = {
@@ -199,6 +213,8 @@ static struct snd_pcm_ops const capture_ops = {
 	.prepare = clara_e_pcm_prepare,
 	.trigger = clara_e_pcm_trigger,
 	.pointer = clara_pcm_pointer,
+	.get_time_info = clara_pcm_get_time_info,
+	PCM_COPY_OPS,
 };
 
 static int create_controls(struct generic_chip *chip)
@@ -212,7 +228,7 @@ static int create_controls(struct generic_chip *chip)
 	else
 		atomic_set(&chip->ctl_id_sample_rate, ctl_id);
 
-	return 0;
+	return clara_e_channel_controls_create(chip);
 }
 
 static void timer_callback(struct generic_chip *chip)
@@ -34,11 +34,16 @@ void clear_device_specifics(struct device_specifics *dev_specifics)
 	dev_specifics->alloc_dma_buffers = NULL;
 	dev_specifics->measure_wordclock_hz = NULL;
 	dev_specifics->irq_handler = NULL;
+	dev_specifics->irq_thread_handler = NULL;
 	dev_specifics->pcm_playback_ops = NULL;
 	dev_specifics->pcm_capture_ops = NULL;
 	dev_specifics->timer_interval_ms = 0;
 	dev_specifics->timer_callback = NULL;
+	dev_specifics->sample_rate_changed = NULL;
+	dev_specifics->get_clock_mode = NULL;
 	dev_specifics->create_controls = NULL;
+	dev_specifics->join_aggregate = NULL;
+	dev_specifics->leave_aggregate = NULL;
 }
 
 bool verify_device_specifics(struct device_specifics *dev_specifics)
@@ -104,6 +109,7 @@ bool verify_device_specifics(struct device_specifics *dev_specifics)
 			"verify_device_specifics: irq_handler is NULL\n");
 		valid = false;
 	}
+	// irq_thread_handler is optional
 	if (dev_specifics->pcm_playback_ops == NULL) {
 		PRINT_ERROR(
 			"verify_device_specifics: pcm_playback_ops is NULL\n");
@@ -124,11 +130,24 @@ bool verify_device_specifics(struct device_specifics *dev_specifics)
 			"verify_device_specifics: timer_callback is NULL\n");
 		valid = false;
 	}
+	if (dev_specifics->sample_rate_changed == NULL) {
+		PRINT_ERROR(
+			"verify_device_specifics: sample_rate_changed is NULL\n");
+		valid = false;
+	}
 	if (dev_specifics->create_controls == NULL) {
 		PRINT_ERROR(
 			"verify_device_specifics: create_controls is NULL\n");
 		valid = false;
 	}
+	// join_aggregate and leave_aggregate are optional, but come in pairs
+	if ((dev_specifics->join_aggregate == NULL) !=
+		(dev_specifics->leave_aggregate == NULL)) {
+		PRINT_ERROR(
+			"verify_device_specifics: join_aggregate and "
+			"leave_aggregate need to be set both\n");
+		valid = false;
+	}
 
 	return valid;
 }
@@ -42,6 +42,7 @@ typedef void (*soft_reset_func)(struct generic_chip *chip);
 typedef int (*create_controls_func)(struct generic_chip *chip);
 typedef void (*indicate_state_func)(struct generic_chip *chip, enum state_indicator state);
 typedef int (*alloc_dma_buffers_func)(struct pci_dev *pci_dev, struct generic_chip *chip);
+typedef int (*join_aggregate_func)(struct generic_chip *chip, unsigned int position);
 
 /* This structure holds the device specific functions
 	and descriptors that can only be determined at runtime.
@@ -64,11 +65,20 @@ struct device_specifics {
 	alloc_dma_buffers_func alloc_dma_buffers;
 	measure_wordclock_hz_func measure_wordclock_hz;
 	irq_handler_t irq_handler;
+	// optional, irq_handler needs to return IRQ_WAKE_THREAD in
+	// threaded mode
+	irq_handler_t irq_thread_handler;
 	struct snd_pcm_ops const *pcm_playback_ops;
 	struct snd_pcm_ops const *pcm_capture_ops;
 	unsigned long timer_interval_ms;
 	timer_callback_func timer_callback;
+	sample_rate_changed_func sample_rate_changed;
+	// optional, non-sleeping read of the clock mode for the rate monitor
+	get_clock_mode_func get_clock_mode;
 	create_controls_func create_controls;
+	// optional, cards that can be part of the aggregate PCM
+	join_aggregate_func join_aggregate;
+	leave_aggregate_func leave_aggregate;
 };
 
 void clear_device_specifics(struct device_specifics *dev_specifics);
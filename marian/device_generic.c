@@ -19,11 +19,21 @@
 #include <linux/delay.h>
 #include <linux/kernel.h>
 #include <linux/atomic.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/version.h>
 #include <sound/core.h>
 #include <sound/control.h>
+#include <sound/info.h>
+#include <sound/memalloc.h>
 #include "dbg_out.h"
 #include "device_generic.h"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 8, 0)
+#define PCI_IRQ_INTX PCI_IRQ_LEGACY
+#endif
+
 #define ADDR_IRQ_STATUS_REG 0x00
 #define ADDR_LED_REG 0xF4
 #define ADDR_SAMPLE_COUNTER_REG 0x8C
@@ -42,6 +52,9 @@ char *clock_mode_names[] = {
 
 static int acquire_pci_resources(struct generic_chip *chip);
 static void release_pci_resources(struct generic_chip *chip);
+static void proc_read_dma_buffers(struct snd_info_entry *entry,
+	struct snd_info_buffer *buffer);
+static void rate_work_func(struct work_struct *work);
 
 /*
 	CHIP MANAGEMENT FUNCTIONS
@@ -63,7 +76,9 @@ int generic_chip_new(struct snd_card *card,
 	int err = 0;
 	struct generic_chip *chip = NULL;
 
-	chip = kzalloc(sizeof(*chip), GFP_KERNEL);
+	// the chip is accessed in every IRQ, keep it close to the card
+	chip = kzalloc_node(sizeof(*chip), GFP_KERNEL,
+		dev_to_node(&pci_dev->dev));
 	if (chip == NULL)
 		return -ENOMEM;
 
@@ -72,20 +87,62 @@ int generic_chip_new(struct snd_card *card,
 	chip->bar0_addr = 0;
 	chip->bar0 = NULL;
 	chip->irq = -1;
+	chip->irq_vectors_allocated = false;
+	chip->irq_threaded = false;
+	chip->irq_thread_priority = 0;
+	cpumask_clear(&chip->irq_affinity);
+	chip->irq_affinity_set = false;
 	chip->pcm = NULL;
-	chip->playback_substream = NULL;
-	chip->capture_substream = NULL;
+	memset(chip->playback_substreams, 0,
+		sizeof(chip->playback_substreams));
+	memset(chip->capture_substreams, 0, sizeof(chip->capture_substreams));
 	chip->dma_status = DMA_STATUS_UNKNOWN;
+	chip->playback_running = 0;
+	chip->capture_running = 0;
+	chip->playback_aggregated = false;
+	chip->capture_aggregated = false;
+	chip->playback_no_period_wakeup = 0;
+	chip->capture_no_period_wakeup = 0;
 	memset(&chip->playback_buf, 0, sizeof(chip->playback_buf));
 	memset(&chip->capture_buf, 0, sizeof(chip->capture_buf));
+	memset(&chip->playback_prealloc, 0, sizeof(chip->playback_prealloc));
+	memset(&chip->capture_prealloc, 0, sizeof(chip->capture_prealloc));
+	chip->dma_prealloc_bytes = 0;
+	generic_set_dma_types(chip, GENERIC_DMA_TYPE_COHERENT,
+		GENERIC_DMA_TYPE_COHERENT);
+	chip->dma_benchmark = false;
+	memset(&chip->playback_benchmark, 0, sizeof(chip->playback_benchmark));
+	memset(&chip->capture_benchmark, 0, sizeof(chip->capture_benchmark));
+	chip->playback_used_bytes = 0;
+	chip->capture_used_bytes = 0;
 	chip->num_buffer_frames = 0;
-	chip->timer_thread = NULL;
+	bitmap_zero(chip->playback_channel_selection, GENERIC_MAX_NUM_CHANNELS);
+	bitmap_zero(chip->capture_channel_selection, GENERIC_MAX_NUM_CHANNELS);
+	chip->num_subdevices = 1;
+	memset(chip->playback_ranges, 0, sizeof(chip->playback_ranges));
+	memset(chip->capture_ranges, 0, sizeof(chip->capture_ranges));
+	chip->pointer_interpolation = false;
+	chip->playback_transport_frames = 0;
+	chip->capture_transport_frames = 0;
+	generic_reset_frame_count(chip);
+	INIT_LIST_HEAD(&chip->timer_entry);
+	chip->timer_due = 0;
+	cpumask_clear(&chip->timer_affinity);
+	chip->timer_affinity_set = false;
 	chip->timer_callback = NULL;
 	chip->measure_wordclock_hz = NULL;
+	mutex_init(&chip->measure_mutex);
+	INIT_DELAYED_WORK(&chip->rate_work, rate_work_func);
+	chip->rate_check_ms = 0;
+	chip->get_clock_mode = NULL;
+	chip->monitor_clock_mode = CLOCK_MODE_48;
+	chip->pending_sample_rate = 0;
+	chip->sample_rate_changed = NULL;
 	chip->timer_interval_ms = 0;
 	chip->specific = NULL;
 	chip->specific_free = NULL;
 	spin_lock_init(&chip->lock);
+	mutex_init(&chip->buffer_mutex);
 	atomic_set(&chip->current_sample_rate, 0);
 	atomic_set(&chip->clock_mode, CLOCK_MODE_48);
 	atomic_set(&chip->ctl_id_sample_rate, 0);
@@ -94,6 +151,11 @@ int generic_chip_new(struct snd_card *card,
 	if (err < 0)
 		goto error;
 
+	// informational only, so do not fail without it
+	if (snd_card_ro_proc_new(card, "dma_buffers", chip,
+		proc_read_dma_buffers) < 0)
+		PRINT_WARN("generic_chip_new: could not create proc entry\n");
+
 	*rchip = chip;
 	PRINT_DEBUG("generic_chip_new: success\n");
 	return 0;
@@ -110,17 +172,26 @@ void generic_chip_free(struct generic_chip *chip)
 	if (chip == NULL)
 		return;
 	if (chip->irq >= 0) {
+		if (chip->irq_affinity_set) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+			irq_update_affinity_hint(chip->irq, NULL);
+#else
+			irq_set_affinity_hint(chip->irq, NULL);
+#endif
+			chip->irq_affinity_set = false;
+		}
 		free_irq(chip->irq, chip);
-		pci_disable_msi(chip->pci_dev);
 		chip->irq = -1;
 		PRINT_DEBUG("free_irq\n");
 	}
 	if (chip->specific_free != NULL)
 		chip->specific_free(chip);
-	if (chip->playback_buf.area != NULL)
-		snd_dma_free_pages(&chip->playback_buf);
-	if (chip->capture_buf.area != NULL)
-		snd_dma_free_pages(&chip->capture_buf);
+	generic_release_dma_buffer(chip, SNDRV_PCM_STREAM_PLAYBACK);
+	generic_release_dma_buffer(chip, SNDRV_PCM_STREAM_CAPTURE);
+	if (chip->playback_prealloc.area != NULL)
+		snd_dma_free_pages(&chip->playback_prealloc);
+	if (chip->capture_prealloc.area != NULL)
+		snd_dma_free_pages(&chip->capture_prealloc);
 	release_pci_resources(chip);
 	kfree(chip);
 	PRINT_DEBUG("chip_free\n");
@@ -148,13 +219,21 @@ static int acquire_pci_resources(struct generic_chip *chip)
 	}
 	pci_set_master(chip->pci_dev);
 
-	if (!pci_enable_msi(chip->pci_dev)) {
-		PRINT_INFO("Using MSI");
-	}
-	else {
-		pci_disable_msi(chip->pci_dev);
-		PRINT_INFO("Falling back to legacy IRQ");
+	// the card signals all events through one vector, reading the status
+	// register tells them apart and acknowledges them
+	err = pci_alloc_irq_vectors(chip->pci_dev, 1, 1,
+		PCI_IRQ_MSIX | PCI_IRQ_MSI | PCI_IRQ_INTX);
+	if (err < 0) {
+		PRINT_ERROR("could not allocate an IRQ vector: %d\n", err);
+		return err;
 	}
+	chip->irq_vectors_allocated = true;
+	if (chip->pci_dev->msix_enabled)
+		PRINT_INFO("Using MSI-X\n");
+	else if (chip->pci_dev->msi_enabled)
+		PRINT_INFO("Using MSI\n");
+	else
+		PRINT_INFO("Falling back to legacy IRQ\n");
 
 	err = pci_request_regions(chip->pci_dev, chip->card->driver);
 	if (err < 0)
@@ -179,6 +258,11 @@ static void release_pci_resources(struct generic_chip *chip)
 
 	pci_clear_master(chip->pci_dev);
 
+	if (chip->irq_vectors_allocated) {
+		pci_free_irq_vectors(chip->pci_dev);
+		chip->irq_vectors_allocated = false;
+	}
+
 	if (chip->bar0 != NULL) {
 		iounmap(chip->bar0);
 		chip->bar0 = NULL;
@@ -194,29 +278,291 @@ static void release_pci_resources(struct generic_chip *chip)
 	PRINT_DEBUG("release_pci_resources\n");
 }
 
-void generic_clear_dma_buffer(struct snd_dma_buffer *buf)
+/* Directs the IRQ of the card to the CPUs in irq_affinity and publishes them
+ * as affinity hint, so irqbalance keeps it there. */
+void generic_set_irq_affinity(struct generic_chip *chip)
 {
-	if (buf == NULL)
+	int err = 0;
+
+	if (chip->irq < 0)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	err = irq_set_affinity_and_hint(chip->irq, &chip->irq_affinity);
+#else
+	err = irq_set_affinity_hint(chip->irq, &chip->irq_affinity);
+#endif
+	if (err < 0) {
+		PRINT_WARN("could not set the IRQ affinity: %d\n", err);
 		return;
-	if (buf->area != NULL) {
-		memset(buf->area, 0, buf->bytes);
 	}
+	chip->irq_affinity_set = true;
+	PRINT_DEBUG("IRQ affinity: %*pbl\n",
+		cpumask_pr_args(&chip->irq_affinity));
+}
+
+/* Non-coherent memory is cached in any case. Where DMA is coherent its
+ * syncs do nothing, elsewhere they do the cache maintenance, so it is the
+ * fastest type everywhere without asking the device. Before 5.15 there is
+ * no such type and coherent memory is used. */
+static int to_snd_dma_type(enum generic_dma_type type)
+{
+	if (type == GENERIC_DMA_TYPE_AUTO)
+		type = GENERIC_DMA_TYPE_NONCOHERENT;
+	switch (type) {
+	case GENERIC_DMA_TYPE_WC:
+		return SNDRV_DMA_TYPE_DEV_WC;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	case GENERIC_DMA_TYPE_NONCOHERENT:
+		return SNDRV_DMA_TYPE_NONCOHERENT;
+#endif
+	default:
+		return SNDRV_DMA_TYPE_DEV;
+	}
+}
+
+/* Selects the memory type of the buffers allocated from now on. Write
+ * combining speeds up writing on platforms where coherent memory is
+ * uncached, but reads stay slow. Non-coherent memory is cached and is
+ * synced explicitly by the PCM core and the driver. */
+void generic_set_dma_types(struct generic_chip *chip,
+	enum generic_dma_type playback, enum generic_dma_type capture)
+{
+	chip->playback_dma_type = to_snd_dma_type(playback);
+	chip->capture_dma_type = to_snd_dma_type(capture);
+}
+
+int generic_dma_type(struct generic_chip *chip, int stream)
+{
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return chip->playback_dma_type;
+	return chip->capture_dma_type;
+}
+
+static char const *dma_type_name(int type)
+{
+	switch (type) {
+	case SNDRV_DMA_TYPE_DEV_WC:
+		return "write-combining";
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	case SNDRV_DMA_TYPE_NONCOHERENT:
+		return "non-coherent";
+#endif
+	default:
+		return "coherent";
+	}
+}
+
+/* Returns the PCM info flags the buffer type requires. With a non-coherent
+ * buffer the PCM core has to sync it whenever the pointers are updated. */
+unsigned int generic_dma_info(struct generic_chip *chip, int stream)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	if (generic_dma_type(chip, stream) == SNDRV_DMA_TYPE_NONCOHERENT)
+		return SNDRV_PCM_INFO_EXPLICIT_SYNC;
+#endif
+	return 0;
+}
+
+/* Makes samples written by the CPU visible to the card. Only non-coherent
+ * buffers need this, for the others it does nothing. */
+void generic_sync_dma_buffer(struct snd_dma_buffer *buf)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	if (buf->area != NULL)
+		snd_dma_buffer_sync(buf, SNDRV_DMA_SYNC_DEVICE);
+#endif
+}
+
+// throughput in MB/s
+static u64 throughput(size_t bytes, u64 ns)
+{
+	return div64_u64((u64)bytes * 1000, max_t(u64, ns, 1));
+}
+
+/* Measures how fast the CPU writes and reads the buffer, which has the same
+ * memory type as the mmap of applications. The buffer must not be in use,
+ * it is zeroed on the way. */
+static void benchmark_dma_buffer(struct generic_chip *chip, int stream,
+	struct snd_dma_buffer *buf)
+{
+	struct generic_dma_benchmark *result =
+		(stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		&chip->playback_benchmark : &chip->capture_benchmark;
+	u64 const *samples = (u64 const *)buf->area;
+	size_t const n = buf->bytes / sizeof(u64);
+	u64 write_ns = 0;
+	u64 read_ns = 0;
+	u64 start = 0;
+	size_t i = 0;
+
+	start = ktime_get_ns();
+	memset(buf->area, 0, buf->bytes);
+	generic_sync_dma_buffer(buf);
+	write_ns = ktime_get_ns() - start;
+
+	start = ktime_get_ns();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	snd_dma_buffer_sync(buf, SNDRV_DMA_SYNC_CPU);
+#endif
+	for (i = 0; i < n; i++)
+		(void)READ_ONCE(samples[i]);
+	read_ns = ktime_get_ns() - start;
+
+	result->type = buf->dev.type;
+	result->bytes = buf->bytes;
+	result->write_mbps = throughput(buf->bytes, write_ns);
+	result->read_mbps = throughput(n * sizeof(u64), read_ns);
+}
+
+static void proc_print_dma_buffer(struct snd_info_buffer *buffer,
+	struct generic_chip *chip, int stream, char const *dir)
+{
+	struct snd_dma_buffer *buf = generic_dma_buffer(chip, stream);
+	struct generic_dma_benchmark *result =
+		(stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		&chip->playback_benchmark : &chip->capture_benchmark;
+
+	snd_iprintf(buffer, "%s node: %d\n", dir,
+		dev_to_node(&chip->pci_dev->dev));
+	snd_iprintf(buffer, "%s type: %s\n", dir,
+		dma_type_name(generic_dma_type(chip, stream)));
+	snd_iprintf(buffer, "%s size: %zu kB%s\n", dir, buf->bytes / 1024,
+		generic_dma_buffer_preallocated(chip, stream) ?
+		" (preallocated)" : "");
+	if (result->bytes == 0)
+		return;
+	snd_iprintf(buffer, "%s benchmark: %s, %zu kB, CPU write %llu MB/s, "
+		"read %llu MB/s\n", dir, dma_type_name(result->type),
+		result->bytes / 1024, result->write_mbps, result->read_mbps);
+}
+
+static void proc_read_dma_buffers(struct snd_info_entry *entry,
+	struct snd_info_buffer *buffer)
+{
+	struct generic_chip *chip = entry->private_data;
+
+	mutex_lock(&chip->buffer_mutex);
+	proc_print_dma_buffer(buffer, chip, SNDRV_PCM_STREAM_PLAYBACK,
+		"playback");
+	proc_print_dma_buffer(buffer, chip, SNDRV_PCM_STREAM_CAPTURE,
+		"capture");
+	mutex_unlock(&chip->buffer_mutex);
+}
+
+struct snd_dma_buffer *generic_dma_buffer(struct generic_chip *chip,
+	int stream)
+{
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return &chip->playback_buf;
+	return &chip->capture_buf;
+}
+
+static struct snd_dma_buffer *prealloc_buffer(struct generic_chip *chip,
+	int stream)
+{
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return &chip->playback_prealloc;
+	return &chip->capture_prealloc;
+}
+
+bool generic_dma_buffer_preallocated(struct generic_chip *chip, int stream)
+{
+	struct snd_dma_buffer *buf = generic_dma_buffer(chip, stream);
+
+	return buf->area != NULL &&
+		buf->area == prealloc_buffer(chip, stream)->area;
+}
+
+/* Provides a buffer of at least the given size for the direction, replacing
+ * the current one. The preallocated buffer is used if it is large enough.
+ * The caller needs to hold buffer_mutex. */
+int generic_alloc_dma_buffer(struct generic_chip *chip, int stream,
+	size_t bytes)
+{
+	struct snd_dma_buffer *buf = generic_dma_buffer(chip, stream);
+	struct snd_dma_buffer *prealloc = prealloc_buffer(chip, stream);
+	int err = 0;
+
+	generic_release_dma_buffer(chip, stream);
+	if (prealloc->area != NULL && prealloc->bytes >= bytes) {
+		*buf = *prealloc;
+		goto allocated;
+	}
+	err = snd_dma_alloc_pages(generic_dma_type(chip, stream),
+		&chip->pci_dev->dev, bytes, buf);
+	if (err < 0) {
+		PRINT_ERROR("could not allocate %zu bytes DMA buffer (%s)\n",
+			bytes, (stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+			"playback" : "capture");
+		memset(buf, 0, sizeof(*buf));
+		return err;
+	}
+	PRINT_DEBUG("allocated %zu bytes DMA buffer (%s)\n", buf->bytes,
+		(stream == SNDRV_PCM_STREAM_PLAYBACK) ? "playback" : "capture");
+	// the zeroes may still be in the cache of the CPU
+	generic_sync_dma_buffer(buf);
+allocated:
+	if (chip->dma_benchmark)
+		benchmark_dma_buffer(chip, stream, buf);
+	return 0;
+}
+
+/* Frees the buffer of the direction, unless it is the preallocated one.
+ * The caller needs to hold buffer_mutex, or the chip is being freed. */
+void generic_release_dma_buffer(struct generic_chip *chip, int stream)
+{
+	struct snd_dma_buffer *buf = generic_dma_buffer(chip, stream);
+
+	if (buf->area != NULL && !generic_dma_buffer_preallocated(chip, stream))
+		snd_dma_free_pages(buf);
+	memset(buf, 0, sizeof(*buf));
+}
+
+/* The enabled channels are packed at the start of the DMA buffer, so a
+ * configuration only touches its leading bytes. Recording the largest such
+ * extent lets the buffer be cleared without writing all of it.
+ * The caller needs to make sure that this runs in a critical section. */
+void generic_mark_dma_buffer_used(struct generic_chip *chip, int stream,
+	size_t bytes)
+{
+	size_t *used = (stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		&chip->playback_used_bytes : &chip->capture_used_bytes;
+
+	*used = max(*used, bytes);
+}
+
+/* Returns the number of leading bytes of the DMA buffer that may hold
+ * samples and considers them cleared, which the caller has to do.
+ * The caller needs to make sure that this runs in a critical section. */
+size_t generic_take_dma_buffer_used(struct generic_chip *chip, int stream)
+{
+	size_t *used = (stream == SNDRV_PCM_STREAM_PLAYBACK) ?
+		&chip->playback_used_bytes : &chip->capture_used_bytes;
+	size_t const bytes = *used;
+
+	*used = 0;
+	return bytes;
 }
 
 /*
 	HARDWARE SPECIFIC FUNCTIONS
 */
 
+/* first_channel is the position of the first channel of the substream
+ * among the channels transferred by the engine, which is only non-zero if
+ * several subdevices share the buffer (see generic_channel_position). */
 int generic_dma_channel_offset(struct snd_pcm_substream *substream,
-	struct snd_pcm_channel_info *info, unsigned long alignment)
+	struct snd_pcm_channel_info *info, unsigned long alignment,
+	unsigned int first_channel)
 {
-	struct generic_chip *chip = snd_pcm_substream_chip(substream);
-	unsigned int channel = info->channel;
+	unsigned int channel = first_channel + info->channel;
+	// the DMA engine packs the enabled hardware channels, so the offset
+	// only depends on the stream channel (see generic_get_channel_enables)
 	switch (alignment) {
 	case SNDRV_PCM_FMTBIT_S32_LE:
 		info->offset = 0;
 		info->step = 32;
-		info->first = channel * chip->num_buffer_frames *
+		info->first = channel * substream->runtime->buffer_size *
 			sizeof(u32) * 8;
 		break;
 	default:
@@ -227,6 +573,124 @@ int generic_dma_channel_offset(struct snd_pcm_substream *substream,
 	return 0;
 }
 
+unsigned long *generic_channel_selection(struct generic_chip *chip,
+	int stream)
+{
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return chip->playback_channel_selection;
+	return chip->capture_channel_selection;
+}
+
+struct snd_pcm_substream **generic_substreams(struct generic_chip *chip,
+	int stream)
+{
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return chip->playback_substreams;
+	return chip->capture_substreams;
+}
+
+/* Returns whether any subdevice of the direction is configured.
+ * The caller needs to make sure that this runs in a critical section. */
+bool generic_configured(struct generic_chip *chip, int stream)
+{
+	struct snd_pcm_substream **substreams =
+		generic_substreams(chip, stream);
+	unsigned int i = 0;
+
+	for (i = 0; i < chip->num_subdevices; i++)
+		if (substreams[i] != NULL)
+			return true;
+	return false;
+}
+
+/* Splits the channels of the card evenly among the subdevices, the ranges
+ * can be changed through the channel range controls later on. Needs to be
+ * called before the PCM is created. */
+void generic_set_num_subdevices(struct generic_chip *chip,
+	unsigned int num_subdevices)
+{
+	unsigned int i = 0;
+
+	num_subdevices = clamp(num_subdevices, 1U,
+		(unsigned int)GENERIC_MAX_NUM_SUBDEVICES);
+	chip->num_subdevices = num_subdevices;
+	for (i = 0; i < num_subdevices; i++) {
+		chip->playback_ranges[i].first =
+			i * (chip->max_num_channels / num_subdevices);
+		chip->playback_ranges[i].count =
+			chip->max_num_channels / num_subdevices;
+		chip->capture_ranges[i] = chip->playback_ranges[i];
+	}
+}
+
+struct generic_channel_range *generic_channel_range(struct generic_chip *chip,
+	int stream, unsigned int subdevice)
+{
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return &chip->playback_ranges[subdevice];
+	return &chip->capture_ranges[subdevice];
+}
+
+/* Ranges beyond max_channels, the channels of the card in the current clock
+ * mode, are left out, their subdevices cannot be used in that mode.
+ * The caller needs to make sure that this runs in a critical section. */
+static void get_range_union(struct generic_chip *chip, int stream,
+	unsigned int max_channels, unsigned long *runion)
+{
+	unsigned int i = 0;
+
+	bitmap_zero(runion, GENERIC_MAX_NUM_CHANNELS);
+	for (i = 0; i < chip->num_subdevices; i++) {
+		struct generic_channel_range *range =
+			generic_channel_range(chip, stream, i);
+		if (range->first + range->count <= max_channels &&
+			range->first + range->count <= GENERIC_MAX_NUM_CHANNELS)
+			bitmap_set(runion, range->first, range->count);
+	}
+}
+
+/* Returns the position of the first channel of a subdevice among the
+ * channels transferred by the engine. All subdevices of a direction share
+ * one buffer, in which the channels of all ranges are packed.
+ * The caller needs to make sure that this runs in a critical section. */
+unsigned int generic_channel_position(struct generic_chip *chip, int stream,
+	unsigned int subdevice, unsigned int max_channels)
+{
+	DECLARE_BITMAP(channels, GENERIC_MAX_NUM_CHANNELS);
+
+	if (chip->num_subdevices <= 1)
+		return 0;
+	get_range_union(chip, stream, max_channels, channels);
+	return bitmap_weight(channels,
+		generic_channel_range(chip, stream, subdevice)->first);
+}
+
+/* Returns the hardware channels to be enabled for a stream with the given
+ * number of channels. The DMA engine only transfers enabled channels and
+ * packs them in ascending order, so stream channel n always maps to the
+ * n-th enabled hardware channel. With several subdevices these are the
+ * channels of all ranges, no matter which subdevices are in use, so the
+ * layout of the buffer does not change while one of them is running.
+ * max_channels are the channels of the card in the current clock mode.
+ * The caller needs to make sure that this runs in a critical section. */
+void generic_get_channel_enables(struct generic_chip *chip, int stream,
+	unsigned int channels, unsigned int max_channels,
+	unsigned long *rchannel_enables)
+{
+	unsigned long *selection = generic_channel_selection(chip, stream);
+
+	if (chip->num_subdevices > 1) {
+		get_range_union(chip, stream, max_channels, rchannel_enables);
+	} else if (bitmap_empty(selection, GENERIC_MAX_NUM_CHANNELS)) {
+		bitmap_zero(rchannel_enables, GENERIC_MAX_NUM_CHANNELS);
+		bitmap_set(rchannel_enables, 0,
+			min_t(unsigned int, channels, GENERIC_MAX_NUM_CHANNELS));
+	} else {
+		bitmap_copy(rchannel_enables, selection,
+			GENERIC_MAX_NUM_CHANNELS);
+	}
+}
+
 int generic_pcm_ioctl(struct snd_pcm_substream *substream, unsigned int cmd,
 	void *arg)
 {
@@ -258,6 +722,80 @@ u32 generic_get_sample_counter(struct generic_chip *chip)
 	return read_reg32_bar0(chip, ADDR_SAMPLE_COUNTER_REG);
 }
 
+/* Extends a sample counter value to the number of frames since the engine
+ * was started. Needs to be fed at least once per buffer, which is the case
+ * as long as the pointer callback runs each period.
+ * An interpolated value may be slightly ahead of the next value read from
+ * the card, so small steps backwards are ignored instead of being taken
+ * as a wrap of the buffer.
+ * The caller needs to make sure that this runs in a critical section. */
+u64 generic_update_frame_count(struct generic_chip *chip, u32 sample_counter)
+{
+	if (sample_counter >= chip->last_sample_counter)
+		chip->frame_count += sample_counter - chip->last_sample_counter;
+	else if (chip->last_sample_counter - sample_counter <=
+		min(GENERIC_SAMPLE_COUNTER_JITTER, chip->num_buffer_frames / 4))
+		return chip->frame_count;
+	else if (chip->num_buffer_frames > chip->last_sample_counter)
+		chip->frame_count += chip->num_buffer_frames -
+			chip->last_sample_counter + sample_counter;
+	chip->last_sample_counter = sample_counter;
+	return chip->frame_count;
+}
+
+/* Remembers a sample counter value read from the card as the base for
+ * generic_interpolate_sample_counter().
+ * The caller needs to make sure that this runs in a critical section. */
+void generic_store_sample_counter(struct generic_chip *chip,
+	u32 sample_counter, ktime_t time)
+{
+	generic_update_frame_count(chip, sample_counter);
+	chip->snapshot_sample_counter = sample_counter;
+	chip->snapshot_time = time;
+	chip->snapshot_valid = true;
+}
+
+/* Estimates the current sample counter from the last stored value and the
+ * time passed since, without accessing the card. Returns false if there is
+ * no stored value younger than max_age, the caller has to read the register
+ * then. The estimate is rounded down to the transfer granularity and kept
+ * one granule behind, so it does not run ahead of the hardware even if the
+ * audio clock is slightly faster than the system clock.
+ * The caller needs to make sure that this runs in a critical section. */
+bool generic_interpolate_sample_counter(struct generic_chip *chip,
+	ktime_t now, ktime_t max_age, unsigned int granularity,
+	u32 *rsample_counter)
+{
+	unsigned int rate = atomic_read(&chip->current_sample_rate);
+	s64 age_ns;
+	u32 frames;
+
+	if (!chip->snapshot_valid || chip->num_buffer_frames == 0 || rate == 0)
+		return false;
+	age_ns = ktime_to_ns(ktime_sub(now, chip->snapshot_time));
+	if (age_ns < 0 || age_ns > ktime_to_ns(max_age))
+		return false;
+	frames = div_u64((u64)age_ns * rate, NSEC_PER_SEC);
+	if (granularity > 1)
+		frames = frames > granularity ?
+			rounddown(frames - granularity, granularity) : 0;
+	*rsample_counter = (chip->snapshot_sample_counter + frames) %
+		chip->num_buffer_frames;
+	return true;
+}
+
+// the caller needs to make sure that this runs in a critical section
+void generic_reset_frame_count(struct generic_chip *chip)
+{
+	chip->last_sample_counter = 0;
+	chip->frame_count = 0;
+	memset(chip->playback_start_frames, 0,
+		sizeof(chip->playback_start_frames));
+	memset(chip->capture_start_frames, 0,
+		sizeof(chip->capture_start_frames));
+	chip->snapshot_valid = false;
+}
+
 u32 generic_get_irq_status(struct generic_chip *chip)
 {
 	return read_reg32_bar0(chip, ADDR_IRQ_STATUS_REG);
@@ -321,26 +859,136 @@ unsigned int generic_measure_wordclock_hz(struct generic_chip *chip,
 	return 0;
 }
 
-void generic_timer_callback(struct generic_chip *chip)
+// whether a measured rate is a standard rate the cards can run at
+static bool valid_sample_rate(unsigned int rate)
 {
-	/// updating some measurements
+	unsigned int i;
+
+	if (generic_sample_rate_to_clock_mode(rate) > CLOCK_MODE_192)
+		return false;
+	for (i = 0; i < ARRAY_SIZE(standard_wordclocks_hz); i++)
+		if (standard_wordclocks_hz[i] == rate)
+			return true;
+	return false;
+}
+
+/* Measures the sample rate and reports a change to user space and to the
+ * card, which stops the streams that no longer match it. Failed (0) and
+ * non-standard readings are ignored, and a known rate is only replaced
+ * once two consecutive readings agree on the new one, so a single bad scan
+ * does not stop the streams. Returns whether the rate changed. Must not be
+ * called from atomic context. */
+bool generic_check_sample_rate(struct generic_chip *chip, bool confirmed)
+{
+	unsigned int new_rate = 0;
+	unsigned int old_rate = 0;
+	struct snd_kcontrol *kctl = NULL;
+
 	// NOTE: all yet implemented cards currently return the current
 	// sample rate on source 0
-	unsigned int new_rate = chip->measure_wordclock_hz(chip, 0);
-	unsigned int old_rate = atomic_read(&chip->current_sample_rate);
+	// the timer thread and the rate monitor may check at the same time,
+	// only one of them takes over a new rate
+	mutex_lock(&chip->measure_mutex);
+	old_rate = atomic_read(&chip->current_sample_rate);
+	new_rate = chip->measure_wordclock_hz(chip, 0);
+	if (!valid_sample_rate(new_rate) || new_rate == old_rate) {
+		chip->pending_sample_rate = 0;
+		mutex_unlock(&chip->measure_mutex);
+		return false;
+	}
+	if (!confirmed && old_rate != 0 &&
+			new_rate != chip->pending_sample_rate) {
+		chip->pending_sample_rate = new_rate;
+		mutex_unlock(&chip->measure_mutex);
+		return false;
+	}
+	chip->pending_sample_rate = 0;
+	// hw_params and prepare check against the new rate from now on
+	atomic_set(&chip->current_sample_rate, new_rate);
+	mutex_unlock(&chip->measure_mutex);
+
+	PRINT_INFO("sample rate changed from %d to %d\n", old_rate, new_rate);
+	if (chip->sample_rate_changed != NULL)
+		chip->sample_rate_changed(chip);
 	// when the sample rate changes, notify the user space
-	if (new_rate != old_rate) {
-		struct snd_kcontrol *kctl = snd_ctl_find_numid(chip->card,
-			(unsigned int)atomic_read(&chip->ctl_id_sample_rate));
-		atomic_set(&chip->current_sample_rate, new_rate);
-		if (kctl != NULL) {
-			snd_ctl_notify(chip->card, SNDRV_CTL_EVENT_MASK_VALUE,
-				&kctl->id);
-			PRINT_DEBUG("timer_callback: "
-				"notified sample rate change\n");
+	kctl = snd_ctl_find_numid(chip->card,
+		(unsigned int)atomic_read(&chip->ctl_id_sample_rate));
+	if (kctl != NULL) {
+		snd_ctl_notify(chip->card, SNDRV_CTL_EVENT_MASK_VALUE,
+			&kctl->id);
+		PRINT_DEBUG("check_sample_rate: notified sample rate change\n");
+	}
+	return true;
+}
+
+void generic_timer_callback(struct generic_chip *chip)
+{
+	/// updating some measurements
+	// the rate monitor takes care of the sample rate if it is running,
+	// unless it only watches the clock mode: a change within the same
+	// clock mode (e.g. 44.1 to 48 kHz) is left to the timer thread
+	if (chip->rate_check_ms == 0 || chip->get_clock_mode != NULL)
+		generic_check_sample_rate(chip, false);
+}
+
+static void rate_work_func(struct work_struct *work)
+{
+	struct generic_chip *chip = container_of(to_delayed_work(work),
+		struct generic_chip, rate_work);
+	enum clock_mode cmode = CLOCK_MODE_48;
+
+	if (chip->get_clock_mode == NULL) {
+		generic_check_sample_rate(chip, false);
+	} else {
+		cmode = chip->get_clock_mode(chip);
+		// the card already switched, so a single valid measurement
+		// is enough; measure again next time until it matches
+		if (cmode != chip->monitor_clock_mode) {
+			generic_check_sample_rate(chip, true);
+			if (generic_sample_rate_to_clock_mode(atomic_read(
+					&chip->current_sample_rate)) == cmode)
+				chip->monitor_clock_mode = cmode;
 		}
-		PRINT_INFO("timer_callback: new sample rate: %d\n", new_rate);
+	}
+	queue_delayed_work(system_highpri_wq, &chip->rate_work,
+		msecs_to_jiffies(chip->rate_check_ms));
+}
+
+/* Checks the sample rate every interval_ms instead of every run of the timer
+ * thread, so streams are stopped soon after a rate change in the Dante
+ * network. The interval is rounded up to jiffies. Cards with get_clock_mode
+ * only have their clock mode read each interval, a register read, and the
+ * word clock is measured when it changes. Otherwise the word clock is
+ * measured each interval and a change takes two checks. An interval of 0
+ * leaves it to the timer thread. */
+void generic_start_rate_monitor(struct generic_chip *chip,
+	unsigned int interval_ms)
+{
+	chip->rate_check_ms = interval_ms;
+	if (chip->get_clock_mode != NULL)
+		chip->monitor_clock_mode = chip->get_clock_mode(chip);
+	if (interval_ms > 0)
+		queue_delayed_work(system_highpri_wq, &chip->rate_work, 0);
+}
+
+void generic_stop_rate_monitor(struct generic_chip *chip)
+{
+	cancel_delayed_work_sync(&chip->rate_work);
+}
+
+/* Stops all running substreams of the PCM with an xrun, so applications
+ * notice that the samples no longer match the configured rate. */
+void generic_pcm_stop_xrun(struct snd_pcm *pcm)
+{
+	struct snd_pcm_substream *substream = NULL;
+	int stream = 0;
 
+	if (pcm == NULL)
+		return;
+	for (stream = 0; stream < 2; stream++) {
+		for (substream = pcm->streams[stream].substream;
+			substream != NULL; substream = substream->next)
+			snd_pcm_stop_xrun(substream);
 	}
 }
 
@@ -402,3 +1050,185 @@ int generic_read_wordclock_control_create(struct generic_chip *chip,
 	};
 	return generic_control_create(chip, &c_new, rcontrol_id);
 }
+
+/* The channel selection is exposed as an array of 32 bit words, one bit per
+ * hardware channel, in the same layout as the channel enable registers. */
+static int channel_selection_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	struct generic_chip *chip = snd_kcontrol_chip(kcontrol);
+
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER64;
+	uinfo->count = DIV_ROUND_UP(chip->max_num_channels, 32);
+	uinfo->value.integer64.min = 0;
+	uinfo->value.integer64.max = 0xFFFFFFFF;
+	uinfo->value.integer64.step = 1;
+	return 0;
+}
+
+static int channel_selection_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct generic_chip *chip = snd_kcontrol_chip(kcontrol);
+	int stream = (int)kcontrol->private_value;
+	u32 words[GENERIC_MAX_NUM_CHANNELS / 32];
+	unsigned long irq_flags;
+	int i = 0;
+
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	bitmap_to_arr32(words, generic_channel_selection(chip, stream),
+		GENERIC_MAX_NUM_CHANNELS);
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+	for (i = 0; i < DIV_ROUND_UP(chip->max_num_channels, 32); i++)
+		ucontrol->value.integer64.value[i] = words[i];
+	return 0;
+}
+
+static int channel_selection_put(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct generic_chip *chip = snd_kcontrol_chip(kcontrol);
+	int stream = (int)kcontrol->private_value;
+	u32 words[GENERIC_MAX_NUM_CHANNELS / 32] = {0};
+	DECLARE_BITMAP(selection, GENERIC_MAX_NUM_CHANNELS);
+	unsigned long *current_selection;
+	unsigned long irq_flags;
+	int changed = 0;
+	int i = 0;
+
+	for (i = 0; i < DIV_ROUND_UP(chip->max_num_channels, 32); i++) {
+		long long val = ucontrol->value.integer64.value[i];
+		if (val < 0 || val > 0xFFFFFFFF)
+			return -EINVAL;
+		words[i] = val;
+	}
+	bitmap_from_arr32(selection, words, GENERIC_MAX_NUM_CHANNELS);
+	if (find_next_bit(selection, GENERIC_MAX_NUM_CHANNELS,
+		chip->max_num_channels) < GENERIC_MAX_NUM_CHANNELS)
+		return -EINVAL;
+
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	// the channel count of an open stream depends on the selection
+	if (chip->pcm->streams[stream].substream_opened > 0) {
+		spin_unlock_irqrestore(&chip->lock, irq_flags);
+		return -EBUSY;
+	}
+	current_selection = generic_channel_selection(chip, stream);
+	if (!bitmap_equal(current_selection, selection,
+		GENERIC_MAX_NUM_CHANNELS)) {
+		bitmap_copy(current_selection, selection,
+			GENERIC_MAX_NUM_CHANNELS);
+		changed = 1;
+	}
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+	return changed;
+}
+
+int generic_channel_selection_control_create(struct generic_chip *chip,
+	char *label, int stream)
+{
+	unsigned int ctl_id = 0;
+	struct snd_kcontrol_new c_new = {
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = label,
+		.private_value = stream,
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = channel_selection_info,
+		.get = channel_selection_get,
+		.put = channel_selection_put
+	};
+	return generic_control_create(chip, &c_new, &ctl_id);
+}
+
+/* The channel range of a subdevice is exposed as two integers, the first
+ * hardware channel (starting at 1) and the number of channels. */
+static int channel_range_info(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_info *uinfo)
+{
+	struct generic_chip *chip = snd_kcontrol_chip(kcontrol);
+
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 2;
+	uinfo->value.integer.min = 1;
+	uinfo->value.integer.max = chip->max_num_channels;
+	uinfo->value.integer.step = 1;
+	return 0;
+}
+
+static int channel_range_get(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct generic_chip *chip = snd_kcontrol_chip(kcontrol);
+	int stream = (int)kcontrol->private_value;
+	struct generic_channel_range *range = generic_channel_range(chip,
+		stream, kcontrol->id.index);
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	ucontrol->value.integer.value[0] = range->first + 1;
+	ucontrol->value.integer.value[1] = range->count;
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+	return 0;
+}
+
+static int channel_range_put(struct snd_kcontrol *kcontrol,
+	struct snd_ctl_elem_value *ucontrol)
+{
+	struct generic_chip *chip = snd_kcontrol_chip(kcontrol);
+	int stream = (int)kcontrol->private_value;
+	struct generic_channel_range *range = generic_channel_range(chip,
+		stream, kcontrol->id.index);
+	long first = ucontrol->value.integer.value[0];
+	long count = ucontrol->value.integer.value[1];
+	unsigned long irq_flags;
+	int changed = 0;
+
+	if (first < 1 || count < 1 || first - 1 + count > chip->max_num_channels)
+		return -EINVAL;
+
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	// the layout of the shared buffer depends on all ranges
+	if (chip->pcm->streams[stream].substream_opened > 0) {
+		spin_unlock_irqrestore(&chip->lock, irq_flags);
+		return -EBUSY;
+	}
+	// two playback subdevices must not write the same channels
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		unsigned int i = 0;
+		for (i = 0; i < chip->num_subdevices; i++) {
+			struct generic_channel_range *other =
+				generic_channel_range(chip, stream, i);
+			if (i == kcontrol->id.index)
+				continue;
+			if (first - 1 < other->first + other->count &&
+				other->first < first - 1 + count) {
+				spin_unlock_irqrestore(&chip->lock, irq_flags);
+				return -EINVAL;
+			}
+		}
+	}
+	if (range->first != first - 1 || range->count != count) {
+		range->first = first - 1;
+		range->count = count;
+		changed = 1;
+	}
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+	return changed;
+}
+
+int generic_channel_range_control_create(struct generic_chip *chip,
+	char *label, int stream, unsigned int subdevice)
+{
+	unsigned int ctl_id = 0;
+	struct snd_kcontrol_new c_new = {
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.name = label,
+		.index = subdevice,
+		.private_value = stream,
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = channel_range_info,
+		.get = channel_range_get,
+		.put = channel_range_put
+	};
+	return generic_control_create(chip, &c_new, &ctl_id);
+}
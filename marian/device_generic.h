@@ -21,6 +21,11 @@
 #include <linux/types.h>
 #include <linux/pci.h>
 #include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
 #include <sound/core.h>
 #include <sound/pcm.h>
 #include <sound/control.h>
@@ -29,6 +34,13 @@
 	iowrite32((val), (chip)->bar0 + (reg))
 #define read_reg32_bar0(chip, reg) \
 	ioread32((chip)->bar0 + (reg))
+// upper bound of max_num_channels of all supported cards
+#define GENERIC_MAX_NUM_CHANNELS 512
+// upper bound of the number of PCM subdevices per direction
+#define GENERIC_MAX_NUM_SUBDEVICES 8
+// largest step backwards of the sample counter that is taken as an
+// inaccuracy of the pointer interpolation rather than a wrap of the buffer
+#define GENERIC_SAMPLE_COUNTER_JITTER 32U
 #define HIGH_ADDR(x) (sizeof (x) > 4 ? (x) >> 32 & 0xffffffff : 0)
 #define LOW_ADDR(x) ((x) & 0xffffffff)
 #define LOCK_ACQUIRE(__lock__, __flags__) { \
@@ -42,6 +54,27 @@
 	}
 
 struct generic_chip;
+// contiguous block of hardware channels, first is zero based
+// memory types of the DMA buffers, see generic_set_dma_types
+enum generic_dma_type {
+	GENERIC_DMA_TYPE_AUTO = 0,
+	GENERIC_DMA_TYPE_COHERENT,
+	GENERIC_DMA_TYPE_WC,
+	GENERIC_DMA_TYPE_NONCOHERENT,
+};
+
+// CPU throughput measured on the last buffer attached to a direction
+struct generic_dma_benchmark {
+	int type;
+	size_t bytes;
+	u64 write_mbps;
+	u64 read_mbps;
+};
+
+struct generic_channel_range {
+	unsigned int first;
+	unsigned int count;
+};
 enum dma_status {
 	DMA_STATUS_UNKNOWN,
 	DMA_STATUS_IDLE,
@@ -57,7 +90,10 @@ enum clock_mode {
 };
 extern char *clock_mode_names[];
 typedef void (*timer_callback_func)(struct generic_chip *chip);
+typedef void (*sample_rate_changed_func)(struct generic_chip *chip);
+typedef enum clock_mode (*get_clock_mode_func)(struct generic_chip *chip);
 typedef unsigned int (*measure_wordclock_hz_func)(struct generic_chip *chip, unsigned int source);
+typedef void (*leave_aggregate_func)(struct generic_chip *chip);
 
 // ALSA specific free operation
 int generic_chip_dev_free(struct snd_device *device);
@@ -68,21 +104,104 @@ struct generic_chip {
 	struct snd_card *card;
 	struct pci_dev *pci_dev;
 	int irq;
+	// MSI-X, MSI or legacy IRQ vector allocated in acquire_pci_resources
+	bool irq_vectors_allocated;
+	// in threaded mode the hard IRQ handler only fetches the status
+	bool irq_threaded;
+	int irq_thread_priority;
+	// the IRQ affinity hint needs to stay valid until it is cleared
+	struct cpumask irq_affinity;
+	bool irq_affinity_set;
+	// serve the pointer callback from the last sample counter value
+	// read from the card instead of reading the register each time
+	bool pointer_interpolation;
+	// delay of the transport inside the card added to the reported delay,
+	// in frames at the current rate, 0 unless measured by the user
+	unsigned int playback_transport_frames;
+	unsigned int capture_transport_frames;
 	unsigned long bar0_addr;
 	void __iomem *bar0;
 	struct snd_pcm *pcm;
 	// used in critical sections start
 	spinlock_t lock;
-	struct snd_pcm_substream *playback_substream;
-	struct snd_pcm_substream *capture_substream;
+	// set while the subdevice is configured (hw_params until hw_free)
+	struct snd_pcm_substream *playback_substreams[GENERIC_MAX_NUM_SUBDEVICES];
+	struct snd_pcm_substream *capture_substreams[GENERIC_MAX_NUM_SUBDEVICES];
+	// one bit per subdevice that is triggered, the engine keeps running
+	// as long as one bit is set
+	unsigned long playback_running;
+	unsigned long capture_running;
+	// the direction is used by the aggregate PCM, so the PCM of the card
+	// itself cannot be opened for it
+	bool playback_aggregated;
+	bool capture_aggregated;
 	enum dma_status dma_status;
+	// one bit per subdevice that does not need period IRQs
+	unsigned long playback_no_period_wakeup;
+	unsigned long capture_no_period_wakeup;
 	unsigned int num_buffer_frames;
+	// hardware channels transferred for each direction, if empty the
+	// first n channels of the card are used
+	DECLARE_BITMAP(playback_channel_selection, GENERIC_MAX_NUM_CHANNELS);
+	DECLARE_BITMAP(capture_channel_selection, GENERIC_MAX_NUM_CHANNELS);
+	// with more than one subdevice each one is bound to a channel range
+	// instead, the engine transfers all channels of all ranges
+	unsigned int num_subdevices;
+	struct generic_channel_range playback_ranges[GENERIC_MAX_NUM_SUBDEVICES];
+	struct generic_channel_range capture_ranges[GENERIC_MAX_NUM_SUBDEVICES];
+	// the sample counter wraps with the buffer, these extend it to the
+	// number of frames since the DMA engine was started
+	u32 last_sample_counter;
+	u64 frame_count;
+	// frame_count when the respective subdevice was triggered
+	u64 playback_start_frames[GENERIC_MAX_NUM_SUBDEVICES];
+	u64 capture_start_frames[GENERIC_MAX_NUM_SUBDEVICES];
+	// last sample counter value read from the card and when it was read
+	u32 snapshot_sample_counter;
+	ktime_t snapshot_time;
+	bool snapshot_valid;
+	// leading part of each DMA buffer that may hold samples
+	size_t playback_used_bytes;
+	size_t capture_used_bytes;
 	// used in critical sections end
+	// allocated in hw_params for the configuration of the direction
 	struct snd_dma_buffer playback_buf;
 	struct snd_dma_buffer capture_buf;
-	struct task_struct *timer_thread;
+	// optionally allocated at probe, used instead of an allocation in
+	// hw_params if large enough
+	struct snd_dma_buffer playback_prealloc;
+	struct snd_dma_buffer capture_prealloc;
+	size_t dma_prealloc_bytes;
+	// SNDRV_DMA_TYPE_* of the buffers of each direction
+	int playback_dma_type;
+	int capture_dma_type;
+	// measure the CPU throughput of each newly attached buffer
+	bool dma_benchmark;
+	struct generic_dma_benchmark playback_benchmark;
+	struct generic_dma_benchmark capture_benchmark;
+	// serializes the allocation of the buffers, which may sleep
+	struct mutex buffer_mutex;
+	// entry of the card in the list of the shared timer thread
+	struct list_head timer_entry;
+	unsigned long timer_due; // jiffies
+	struct cpumask timer_affinity;
+	bool timer_affinity_set;
 	timer_callback_func timer_callback;
 	measure_wordclock_hz_func measure_wordclock_hz;
+	// serializes the word clock measurements, which share one scanner
+	struct mutex measure_mutex;
+	// checks the sample rate every rate_check_ms, 0: by the timer thread
+	struct delayed_work rate_work;
+	unsigned int rate_check_ms;
+	// optional, cheap non-sleeping read of the clock mode set by the card,
+	// the rate monitor only measures the sample rate when it changes
+	get_clock_mode_func get_clock_mode;
+	enum clock_mode monitor_clock_mode;
+	// new rate seen by the last check, to be confirmed by the next one
+	unsigned int pending_sample_rate;
+	sample_rate_changed_func sample_rate_changed;
+	// set while the card is part of the aggregate PCM
+	leave_aggregate_func leave_aggregate;
 	unsigned long timer_interval_ms;
 	atomic_t current_sample_rate;
 	atomic_t clock_mode;
@@ -110,21 +229,66 @@ enum state_indicator {
 void generic_indicate_state(struct generic_chip *chip,
 	enum state_indicator state);
 int generic_dma_channel_offset(struct snd_pcm_substream *substream,
-	struct snd_pcm_channel_info *info, unsigned long alignment);
+	struct snd_pcm_channel_info *info, unsigned long alignment,
+	unsigned int first_channel);
+unsigned long *generic_channel_selection(struct generic_chip *chip,
+	int stream);
+struct snd_pcm_substream **generic_substreams(struct generic_chip *chip,
+	int stream);
+bool generic_configured(struct generic_chip *chip, int stream);
+void generic_set_num_subdevices(struct generic_chip *chip,
+	unsigned int num_subdevices);
+struct generic_channel_range *generic_channel_range(struct generic_chip *chip,
+	int stream, unsigned int subdevice);
+unsigned int generic_channel_position(struct generic_chip *chip, int stream,
+	unsigned int subdevice, unsigned int max_channels);
+void generic_get_channel_enables(struct generic_chip *chip, int stream,
+	unsigned int channels, unsigned int max_channels,
+	unsigned long *rchannel_enables);
 int generic_pcm_ioctl(struct snd_pcm_substream *substream, unsigned int cmd,
 	void *arg);
 inline u32 generic_get_sample_counter(struct generic_chip *chip);
+u64 generic_update_frame_count(struct generic_chip *chip, u32 sample_counter);
+void generic_reset_frame_count(struct generic_chip *chip);
+void generic_store_sample_counter(struct generic_chip *chip,
+	u32 sample_counter, ktime_t time);
+bool generic_interpolate_sample_counter(struct generic_chip *chip,
+	ktime_t now, ktime_t max_age, unsigned int granularity,
+	u32 *rsample_counter);
 inline u32 generic_get_irq_status(struct generic_chip *chip);
 inline u32 generic_get_build_no(struct generic_chip *chip);
 void generic_timer_callback(struct generic_chip *chip);
+bool generic_check_sample_rate(struct generic_chip *chip, bool confirmed);
+void generic_start_rate_monitor(struct generic_chip *chip,
+	unsigned int interval_ms);
+void generic_stop_rate_monitor(struct generic_chip *chip);
+void generic_pcm_stop_xrun(struct snd_pcm *pcm);
 enum clock_mode generic_sample_rate_to_clock_mode(unsigned int sample_rate);
 unsigned int generic_measure_wordclock_hz(struct generic_chip *chip,
 	unsigned int source);
 unsigned int generic_snap_to_standard_wc_hz(unsigned int freq_hz);
 int generic_read_wordclock_control_create(struct generic_chip *chip,
 	char *label, unsigned int idx, unsigned int *rcontrol_id);
-void generic_clear_dma_buffer(struct snd_dma_buffer *buf);
+void generic_set_irq_affinity(struct generic_chip *chip);
+void generic_set_dma_types(struct generic_chip *chip,
+	enum generic_dma_type playback, enum generic_dma_type capture);
+int generic_dma_type(struct generic_chip *chip, int stream);
+unsigned int generic_dma_info(struct generic_chip *chip, int stream);
+void generic_sync_dma_buffer(struct snd_dma_buffer *buf);
+struct snd_dma_buffer *generic_dma_buffer(struct generic_chip *chip,
+	int stream);
+bool generic_dma_buffer_preallocated(struct generic_chip *chip, int stream);
+int generic_alloc_dma_buffer(struct generic_chip *chip, int stream,
+	size_t bytes);
+void generic_release_dma_buffer(struct generic_chip *chip, int stream);
+void generic_mark_dma_buffer_used(struct generic_chip *chip, int stream,
+	size_t bytes);
+size_t generic_take_dma_buffer_used(struct generic_chip *chip, int stream);
 int generic_control_create(struct generic_chip *chip,
 	struct snd_kcontrol_new *c_new, unsigned int *rcontrol_id);
+int generic_channel_selection_control_create(struct generic_chip *chip,
+	char *label, int stream);
+int generic_channel_range_control_create(struct generic_chip *chip,
+	char *label, int stream, unsigned int subdevice);
 
 #endif
@@ -16,6 +16,13 @@
  */
 
 #include <linux/irqreturn.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/version.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#include <sound/info.h>
 #include "dbg_out.h"
 #include "clara.h"
 #include "dma_ng.h"
@@ -44,33 +51,303 @@
 #define ADDR_XILINX_H2C_REG 0x4
 #define ADDR_XILINX_C2H_REG 0x1004
 #define ADDR_XILINX_IRQ_ENABLE_REG 0x2004
-// to make things not too complicated, we fix the number of channels per slice
-#define NUM_CHANNEL_ENABLE_REGS 16
+
+#define to_dma_ng(chip) (&((struct clara_chip *)((chip)->specific))->dma)
+#define to_dma_ng_direction(chip, playback) \
+	((playback) ? &to_dma_ng(chip)->playback : &to_dma_ng(chip)->capture)
+
+/* Configuration register writes go through the shadow cache. Only use these
+ * for registers without side effects on write and always call them in a
+ * critical section. */
+static void write_reg32_bar0_shadowed(struct generic_chip *chip,
+	unsigned int reg, u32 val)
+{
+	struct dma_ng *dma = to_dma_ng(chip);
+	unsigned int idx = reg / REG_ADDR_INCREASE;
+
+	if (test_bit(idx, dma->bar0_shadow_valid) &&
+		dma->bar0_shadow[idx] == val)
+		return;
+	write_reg32_bar0(chip, reg, val);
+	dma->bar0_shadow[idx] = val;
+	__set_bit(idx, dma->bar0_shadow_valid);
+}
+
+static void write_reg32_bar1_shadowed(struct generic_chip *chip,
+	unsigned int reg, u32 val)
+{
+	struct dma_ng *dma = to_dma_ng(chip);
+	unsigned int idx = reg >> 12;
+
+	if (test_bit(idx, dma->bar1_shadow_valid) &&
+		dma->bar1_shadow[idx] == val)
+		return;
+	write_reg32_bar1(chip, reg, val);
+	dma->bar1_shadow[idx] = val;
+	__set_bit(idx, dma->bar1_shadow_valid);
+}
+
+static void invalidate_shadow(struct generic_chip *chip)
+{
+	struct dma_ng *dma = to_dma_ng(chip);
+
+	bitmap_zero(dma->bar0_shadow_valid, DMA_NG_BAR0_SHADOW_REGS);
+	bitmap_zero(dma->bar1_shadow_valid, DMA_NG_BAR1_SHADOW_REGS);
+}
+
+/* All subdevices of a direction share the period layout, so they are
+ * signalled together. Substreams without period wakeup are left alone. This
+ * also keeps all but one card of the aggregate PCM from signalling the same
+ * substream. */
+static void period_elapsed(struct dma_ng_direction *dir)
+{
+	struct generic_chip *chip = dir->chip;
+	int const stream = dir->playback ? SNDRV_PCM_STREAM_PLAYBACK :
+		SNDRV_PCM_STREAM_CAPTURE;
+	struct snd_pcm_substream **substreams =
+		generic_substreams(chip, stream);
+	unsigned long no_period_wakeup = dir->playback ?
+		chip->playback_no_period_wakeup :
+		chip->capture_no_period_wakeup;
+	unsigned int i = 0;
+
+	for (i = 0; i < chip->num_subdevices; i++) {
+		struct snd_pcm_substream *substream = READ_ONCE(substreams[i]);
+		if (substream && !test_bit(i, &no_period_wakeup))
+			snd_pcm_period_elapsed(substream);
+	}
+}
+
+/* The FPGA only knows about pages. If there is more than one period per
+ * page, the remaining period boundaries are derived from the page IRQ.
+ * The position itself is always read from the sample counter so a small
+ * drift between the timer and the Dante clock does not matter. With pointer
+ * interpolation the counter is read here as well, the estimate is kept
+ * behind the hardware and would end up just before the period boundary. */
+static enum hrtimer_restart period_timer_func(struct hrtimer *timer)
+{
+	struct dma_ng_direction *dir = container_of(timer,
+		struct dma_ng_direction, period_timer);
+	struct generic_chip *chip = dir->chip;
+	bool restart = false;
+	u32 sample_counter = 0;
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	if (dir->pending_period_ticks == 0 ||
+		chip->dma_status != DMA_STATUS_RUNNING) {
+		spin_unlock_irqrestore(&chip->lock, irq_flags);
+		return HRTIMER_NORESTART;
+	}
+	dir->pending_period_ticks--;
+	restart = (dir->pending_period_ticks > 0);
+	if (chip->pointer_interpolation) {
+		// read under the lock like in clara_pointer()
+		sample_counter = generic_get_sample_counter(chip);
+		generic_store_sample_counter(chip, sample_counter, ktime_get());
+	}
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+	atomic_long_inc(&to_dma_ng(chip)->stats.period_ticks);
+
+	period_elapsed(dir);
+	if (!restart)
+		return HRTIMER_NORESTART;
+	hrtimer_forward_now(timer, dir->period_time);
+	return HRTIMER_RESTART;
+}
+
+static void start_period_ticks(struct dma_ng_direction *dir)
+{
+	struct generic_chip *chip = dir->chip;
+	unsigned long irq_flags;
+
+	// runs in IRQ or IRQ thread context
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	if (dir->enabled && dir->periods_per_page > 1 &&
+		chip->dma_status == DMA_STATUS_RUNNING) {
+		dir->pending_period_ticks = dir->periods_per_page - 1;
+		hrtimer_start(&dir->period_timer, dir->period_time,
+			HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&chip->lock, irq_flags);
+}
+
+static void stop_period_ticks(struct dma_ng_direction *dir)
+{
+	// the caller needs to make sure that this runs in a critical section
+	// we might be called from within the timer callback's stream lock,
+	// so do not wait for the callback here
+	dir->pending_period_ticks = 0;
+	hrtimer_try_to_cancel(&dir->period_timer);
+}
+
+static void init_direction(struct generic_chip *chip,
+	struct dma_ng_direction *dir, bool playback)
+{
+	memset(dir, 0, sizeof(*dir));
+	dir->chip = chip;
+	dir->playback = playback;
+	dir->periods_per_page = 1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&dir->period_timer, period_timer_func,
+		CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&dir->period_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dir->period_timer.function = period_timer_func;
+#endif
+}
+
+static void reset_stats(struct dma_ng_stats *stats)
+{
+	atomic_long_set(&stats->irqs, 0);
+	atomic_long_set(&stats->spurious_irqs, 0);
+	atomic_long_set(&stats->prepare_irqs, 0);
+	atomic_long_set(&stats->period_irqs, 0);
+	atomic_long_set(&stats->dangling_irqs, 0);
+	atomic_long_set(&stats->period_ticks, 0);
+	atomic_long_set(&stats->latency_sum_ns, 0);
+	WRITE_ONCE(stats->latency_min_ns, ULONG_MAX);
+	WRITE_ONCE(stats->latency_max_ns, 0);
+}
+
+/* The IRQ is raised at a page boundary, so the sample counter's distance to
+ * the last boundary tells how late the periods get signalled. This includes
+ * the IRQ thread's scheduling latency in threaded mode. */
+static void update_latency_stats(struct generic_chip *chip,
+	u32 sample_counter)
+{
+	struct dma_ng_stats *stats = &to_dma_ng(chip)->stats;
+	unsigned int page_frames = chip->num_buffer_frames / DMA_NUM_PAGES;
+	unsigned int rate = atomic_read(&chip->current_sample_rate);
+	unsigned long latency_ns;
+
+	if (page_frames == 0 || rate == 0)
+		return;
+	latency_ns = div_u64((u64)(sample_counter % page_frames) *
+		NSEC_PER_SEC, rate);
+	atomic_long_add(latency_ns, &stats->latency_sum_ns);
+	if (latency_ns < READ_ONCE(stats->latency_min_ns))
+		WRITE_ONCE(stats->latency_min_ns, latency_ns);
+	if (latency_ns > READ_ONCE(stats->latency_max_ns))
+		WRITE_ONCE(stats->latency_max_ns, latency_ns);
+}
+
+static void proc_read_stats(struct snd_info_entry *entry,
+	struct snd_info_buffer *buffer)
+{
+	struct generic_chip *chip = entry->private_data;
+	struct dma_ng_stats *stats = &to_dma_ng(chip)->stats;
+	unsigned long period_irqs = atomic_long_read(&stats->period_irqs);
+	unsigned long latency_min_ns = READ_ONCE(stats->latency_min_ns);
+
+	snd_iprintf(buffer, "irqs: %lu\n",
+		atomic_long_read(&stats->irqs));
+	snd_iprintf(buffer, "spurious irqs: %lu\n",
+		atomic_long_read(&stats->spurious_irqs));
+	snd_iprintf(buffer, "prepare irqs: %lu\n",
+		atomic_long_read(&stats->prepare_irqs));
+	snd_iprintf(buffer, "period irqs: %lu\n", period_irqs);
+	snd_iprintf(buffer, "dangling irqs: %lu\n",
+		atomic_long_read(&stats->dangling_irqs));
+	snd_iprintf(buffer, "period timer ticks: %lu\n",
+		atomic_long_read(&stats->period_ticks));
+	snd_iprintf(buffer, "period latency min: %lu us\n",
+		period_irqs ? latency_min_ns / NSEC_PER_USEC : 0);
+	snd_iprintf(buffer, "period latency avg: %lu us\n",
+		period_irqs ? atomic_long_read(&stats->latency_sum_ns) /
+		period_irqs / NSEC_PER_USEC : 0);
+	snd_iprintf(buffer, "period latency max: %lu us\n",
+		READ_ONCE(stats->latency_max_ns) / NSEC_PER_USEC);
+}
+
+void dma_ng_init(struct generic_chip *chip)
+{
+	struct dma_ng *dma = to_dma_ng(chip);
+
+	dma->chip = chip;
+	dma->page_time = 0;
+	atomic_set(&dma->irq_status, 0);
+	dma->irq_thread_priority_applied = false;
+	dma->interrupts_enabled = false;
+	dma->slice_channels = 0;
+	init_direction(chip, &dma->playback, true);
+	init_direction(chip, &dma->capture, false);
+	invalidate_shadow(chip);
+	reset_stats(&dma->stats);
+	// statistics are informational only, so do not fail without them
+	if (snd_card_ro_proc_new(chip->card, "irq_stats", chip,
+		proc_read_stats) < 0)
+		PRINT_WARN("dma_ng_init: could not create proc entry\n");
+}
+
+void dma_ng_free(struct generic_chip *chip)
+{
+	dma_ng_sync_period_ticks(chip);
+}
+
+/* Waits for running period timer callbacks to finish. Must not be called
+ * from atomic context. */
+void dma_ng_sync_period_ticks(struct generic_chip *chip)
+{
+	hrtimer_cancel(&to_dma_ng(chip)->playback.period_timer);
+	hrtimer_cancel(&to_dma_ng(chip)->capture.period_timer);
+}
+
+/* The capture IRQ is only needed if at least one substream wants to be woken
+ * up each period. Substreams that set SNDRV_PCM_INFO_NO_PERIOD_WAKEUP poll
+ * the sample counter instead. */
+static bool period_irq_needed(struct generic_chip *chip)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < chip->num_subdevices; i++) {
+		if (chip->playback_substreams[i] &&
+			!test_bit(i, &chip->playback_no_period_wakeup))
+			return true;
+		if (chip->capture_substreams[i] &&
+			!test_bit(i, &chip->capture_no_period_wakeup))
+			return true;
+	}
+	return false;
+}
 
 static int enable_interrupts(struct generic_chip *chip)
 {
 	// enable xilinx core interrupts and transport engine
-	write_reg32_bar1(chip, ADDR_XILINX_H2C_REG, 1);
-	write_reg32_bar1(chip, ADDR_XILINX_C2H_REG, 1);
-	write_reg32_bar1(chip, ADDR_XILINX_IRQ_ENABLE_REG, 1);
+	write_reg32_bar1_shadowed(chip, ADDR_XILINX_H2C_REG, 1);
+	write_reg32_bar1_shadowed(chip, ADDR_XILINX_C2H_REG, 1);
+	write_reg32_bar1_shadowed(chip, ADDR_XILINX_IRQ_ENABLE_REG, 1);
 	// enable capture interrupts (besides the prepare IRQ the only one
 	// we are interested in)
 	// DMA loopback stays disabled (bits == 0)
-	write_reg32_bar0(chip,
+	write_reg32_bar0_shadowed(chip,
 		ADDR_IRQ_DISABLE_REG,
-		MASK_IRQ_DISABLE_PLAYBACK | MASK_IRQ_SKIP_PREPARE);
+		MASK_IRQ_DISABLE_PLAYBACK | MASK_IRQ_SKIP_PREPARE |
+		(period_irq_needed(chip) ? 0 : MASK_IRQ_DISABLE_CAPTURE));
+	to_dma_ng(chip)->interrupts_enabled = true;
 	return 0;
 }
 
+/* Re-evaluates the interrupt mask after a substream went away.
+ * The caller needs to make sure that this runs in a critical section. */
+int dma_ng_update_interrupts(struct generic_chip *chip)
+{
+	if (!to_dma_ng(chip)->interrupts_enabled)
+		return 0;
+	return enable_interrupts(chip);
+}
+
 int dma_ng_disable_interrupts(struct generic_chip *chip)
 {
+	// the caller needs to make sure that this runs in a critical section
 	// disable all interrupts
-	write_reg32_bar0(chip, ADDR_IRQ_DISABLE_REG,
+	write_reg32_bar0_shadowed(chip, ADDR_IRQ_DISABLE_REG,
 		MASK_IRQ_DISABLE_CAPTURE | MASK_IRQ_DISABLE_PLAYBACK);
 	// disable xilinx core interrupts and transport engine
-	write_reg32_bar1(chip, ADDR_XILINX_H2C_REG, 0);
-	write_reg32_bar1(chip, ADDR_XILINX_C2H_REG, 0);
-	write_reg32_bar1(chip, ADDR_XILINX_IRQ_ENABLE_REG, 0);
+	write_reg32_bar1_shadowed(chip, ADDR_XILINX_H2C_REG, 0);
+	write_reg32_bar1_shadowed(chip, ADDR_XILINX_C2H_REG, 0);
+	write_reg32_bar1_shadowed(chip, ADDR_XILINX_IRQ_ENABLE_REG, 0);
+	to_dma_ng(chip)->interrupts_enabled = false;
 	return 0;
 }
 
@@ -90,6 +367,8 @@ static int reset_engine(struct generic_chip *chip)
 			return 0;
 		}
 		write_reg32_bar0(chip, ADDR_RESET_DMA_ENGINE_REG, 0);
+		// do not rely on the configuration surviving the reset
+		invalidate_shadow(chip);
 	}
 
 	PRINT_ERROR("reset_engine: machine not idle after "
@@ -98,105 +377,296 @@ static int reset_engine(struct generic_chip *chip)
 	return -EIO;
 }
 
-int dma_ng_prepare(struct generic_chip *chip, unsigned int channels,
-	bool playback, u64 host_base_addr, unsigned int num_blocks,
-	unsigned int channels_per_dma_slice)
+/* The engine packs the enabled channels of a direction one after the other
+ * into the host buffer, a slice holds the channels transferred per block.
+ * The driver relies on that layout throughout: the buffers are allocated
+ * for the enabled channels only (see clara_e buffer_channels) and the
+ * channel offsets count enabled channels (generic_channel_position). So the
+ * slice is the number of enabled channels, not the highest one, and a
+ * selection like channels 400 and 401 is a slice of 2.
+ * Both directions share one slice register, so it has to cover the channels
+ * of both of them. Keeping it as small as possible keeps the engine from
+ * transferring more than the buffers hold. It is only changed
+ * while the engine is idle, a running direction keeps the slice it was
+ * started with. The last configuration of a disabled direction is covered as
+ * well, so that direction can join the running engine again. */
+static void update_slice_size(struct generic_chip *chip)
 {
-	u32 channel_enables[NUM_CHANNEL_ENABLE_REGS] = {0};
+	struct dma_ng *dma = to_dma_ng(chip);
+	unsigned int slice_channels = max(dma->playback.slice_channels,
+		dma->capture.slice_channels);
+
+	// the caller needs to make sure that this runs in a critical section
+	if (chip->dma_status != DMA_STATUS_IDLE || slice_channels == 0)
+		return;
+	write_reg32_bar0_shadowed(chip, ADDR_NUM_SLICES_REG, slice_channels);
+	dma->slice_channels = slice_channels;
+}
+
+/* Writes the stored channel configuration of one direction to the engine or
+ * clears it. The slice is updated before channels are enabled and after they
+ * are disabled, as far as the engine is idle. */
+static void write_channel_enables(struct generic_chip *chip, bool playback,
+	bool enable)
+{
+	struct dma_ng_direction *dir = to_dma_ng_direction(chip, playback);
 	int i = 0;
 
 	// the caller needs to make sure that this runs in a critical section
-	if (chip->dma_status != DMA_STATUS_RUNNING)
+	if (enable) {
+		dir->enabled = true;
+		update_slice_size(chip);
+	}
+	for (i = 0; i < NUM_CHANNEL_ENABLE_REGS; i++) {
+		write_reg32_bar0_shadowed(chip, (playback ?
+			ADDR_BASE_PLAYBACK_CHANNELS_REGS :
+			ADDR_BASE_CAPTURE_CHANNELS_REGS) +
+			i * REG_ADDR_INCREASE,
+			enable ? dir->channel_enables[i] : 0);
+	}
+	if (!enable) {
+		dir->enabled = false;
+		stop_period_ticks(dir);
+		update_slice_size(chip);
+	}
+}
+
+/* If the engine is already running for the other direction, only the host
+ * address, the channel configuration and the period layout of this direction
+ * are updated. The block ring is shared and has to match, and the direction
+ * stays disabled until dma_ng_enable_channels() is called on trigger. */
+int dma_ng_prepare(struct generic_chip *chip,
+	unsigned long const *channel_enables_map,
+	bool playback, u64 host_base_addr, unsigned int num_blocks,
+	unsigned int num_periods, unsigned int max_channels_per_dma_slice)
+{
+	struct dma_ng *dma = to_dma_ng(chip);
+	struct dma_ng_direction *dir = to_dma_ng_direction(chip, playback);
+	unsigned int channels = bitmap_weight(channel_enables_map,
+		NUM_CHANNEL_ENABLE_REGS * 32);
+	unsigned int slice_channels = 0;
+	unsigned int rate = atomic_read(&chip->current_sample_rate);
+	bool const running = (chip->dma_status == DMA_STATUS_RUNNING);
+
+	// the caller needs to make sure that this runs in a critical section
+	if (!running)
 		if (reset_engine(chip) < 0)
 			return -EIO;
 
-	// TODO ToG: for now we work with the channels per slice being
-	// fixed the max. number of channels the card can handle
-	if (channels > channels_per_dma_slice) {
-		PRINT_ERROR("dma_ng_prepare: channels > channels_per_dma_slice\n");
+	// enabled channels are packed, see update_slice_size()
+	slice_channels = channels;
+	if (slice_channels > max_channels_per_dma_slice) {
+		PRINT_ERROR("dma_ng_prepare: channels > "
+			"max_channels_per_dma_slice\n");
 		// if the card is configured correctly, this should never happen
 		return -EINVAL;
 	}
+	if (running && slice_channels > dma->slice_channels) {
+		PRINT_ERROR("dma_ng_prepare: %d channels exceed the slice "
+			"of the running engine (%d channels)\n",
+			slice_channels, dma->slice_channels);
+		return -EBUSY;
+	}
 
-	for (i = 0; i < channels; i++) {
-		channel_enables[i / 32] |= (1 << (i % 32));
+	// each page needs to hold a whole number of periods, otherwise the
+	// page IRQ would not line up with a period boundary
+	if (num_periods < DMA_MIN_NUM_PERIODS ||
+		num_periods > DMA_MAX_NUM_PERIODS ||
+		num_periods % DMA_NUM_PAGES != 0 ||
+		num_blocks % num_periods != 0 ||
+		num_blocks > DMA_MAX_NUM_BLOCKS) {
+		PRINT_ERROR("dma_ng_prepare: invalid ring: %d blocks, "
+			"%d periods\n", num_blocks, num_periods);
+		return -EINVAL;
 	}
-	for (i = 0; i < NUM_CHANNEL_ENABLE_REGS; i++) {
-		write_reg32_bar0(chip, (playback ?
-			ADDR_BASE_PLAYBACK_CHANNELS_REGS :
-			ADDR_BASE_CAPTURE_CHANNELS_REGS) +
-			i * REG_ADDR_INCREASE, channel_enables[i]);
+	if (rate == 0) {
+		PRINT_ERROR("dma_ng_prepare: no valid sample rate\n");
+		return -EIO;
+	}
+
+	// a previous configuration of this direction must not be transferred
+	// while the host address changes
+	write_channel_enables(chip, playback, false);
+	// the channel map uses the same bit order as the enable registers
+	bitmap_to_arr32(dir->channel_enables, channel_enables_map,
+		NUM_CHANNEL_ENABLE_REGS * 32);
+	dir->slice_channels = slice_channels;
+
+	// the period layout is private to the direction
+	dir->periods_per_page = num_periods / DMA_NUM_PAGES;
+	dir->period_time = ns_to_ktime(div_u64((u64)(num_blocks / num_periods) *
+		DMA_SAMPLES_PER_BLOCK * NSEC_PER_SEC, rate));
+	if (!running) {
+		dma->page_time = ns_to_ktime(div_u64((u64)num_blocks *
+			DMA_SAMPLES_PER_BLOCK * NSEC_PER_SEC,
+			(u64)rate * DMA_NUM_PAGES));
+		write_reg32_bar0_shadowed(chip, ADDR_NUM_BLOCKS_REG,
+			num_blocks);
 	}
-	write_reg32_bar0(chip, ADDR_NUM_BLOCKS_REG, num_blocks);
-	write_reg32_bar0(chip, ADDR_NUM_SLICES_REG, channels_per_dma_slice);
 	if (playback) {
-		write_reg32_bar0(chip,
+		write_reg32_bar0_shadowed(chip,
 			ADDR_BASE_PLAYBACK_HOST_ADDR_REGS,
 			LOW_ADDR(host_base_addr));
-		write_reg32_bar0(chip,
+		write_reg32_bar0_shadowed(chip,
 			ADDR_BASE_PLAYBACK_HOST_ADDR_REGS + 4,
 			HIGH_ADDR(host_base_addr));
 	}
 	else {
-		write_reg32_bar0(chip,
+		write_reg32_bar0_shadowed(chip,
 			ADDR_BASE_CAPTURE_HOST_ADDR_REGS,
 			LOW_ADDR(host_base_addr));
-		write_reg32_bar0(chip,
+		write_reg32_bar0_shadowed(chip,
 			ADDR_BASE_CAPTURE_HOST_ADDR_REGS + 4,
 			HIGH_ADDR(host_base_addr));
 	}
+	// dma_ng_start() picks up all enabled directions at once
+	if (!running)
+		write_channel_enables(chip, playback, true);
 
 	enable_interrupts(chip);
 	return 0;
 }
 
-int dma_ng_start(struct generic_chip *chip)
+/* Arms the engine without starting it, dma_ng_release() starts it. This
+ * allows to start the engines of several cards back to back. */
+int dma_ng_arm(struct generic_chip *chip)
 {
+	// the caller needs to make sure that this runs in a critical section
 	if (chip->dma_status != DMA_STATUS_IDLE)
 		return -EIO;
+	// the sample counter restarts with the engine
+	generic_reset_frame_count(chip);
+	write_reg32_bar0(chip, ADDR_PREPARE_RUN_REG, MASK_ENGINE_PREPARE);
+	chip->dma_status = DMA_STATUS_PREPARED;
+	return 0;
+}
+
+int dma_ng_release(struct generic_chip *chip)
+{
+	// the caller needs to make sure that this runs in a critical section
+	if (chip->dma_status != DMA_STATUS_PREPARED)
+		return -EIO;
 	write_reg32_bar0(chip, ADDR_PREPARE_RUN_REG,
 		MASK_ENGINE_PREPARE | MASK_ENGINE_RUN);
 	chip->dma_status = DMA_STATUS_RUNNING;
 	return 0;
 }
 
+int dma_ng_start(struct generic_chip *chip)
+{
+	int err = dma_ng_arm(chip);
+
+	if (err < 0)
+		return err;
+	return dma_ng_release(chip);
+}
+
 int dma_ng_stop(struct generic_chip *chip)
 {
 	write_reg32_bar0(chip, ADDR_PREPARE_RUN_REG, 0);
 	chip->dma_status = DMA_STATUS_IDLE;
+	chip->snapshot_valid = false;
+	stop_period_ticks(&to_dma_ng(chip)->playback);
+	stop_period_ticks(&to_dma_ng(chip)->capture);
+	return 0;
+}
+
+int dma_ng_enable_channels(struct generic_chip *chip, bool playback)
+{
+	// the caller needs to make sure that this runs in a critical section
+	write_channel_enables(chip, playback, true);
 	return 0;
 }
 
 int dma_ng_disable_channels(struct generic_chip *chip, bool playback)
 {
-	int i = 0;
-	for (i = 0; i < NUM_CHANNEL_ENABLE_REGS; i++) {
-		write_reg32_bar0(chip, (playback ?
-			ADDR_BASE_PLAYBACK_CHANNELS_REGS :
-			ADDR_BASE_CAPTURE_CHANNELS_REGS) +
-			i * REG_ADDR_INCREASE, 0);
-	}
+	// the caller needs to make sure that this runs in a critical section
+	write_channel_enables(chip, playback, false);
 	return 0;
 }
 
-irqreturn_t dma_ng_irq_handler(int irq, void *dev_id)
+static void handle_irq_status(struct generic_chip *chip, u32 val)
 {
-	struct generic_chip *chip = dev_id;
-	u32 val = generic_get_irq_status(chip);
-	if (val == 0)
-		return IRQ_NONE;
+	struct dma_ng_stats *stats = &to_dma_ng(chip)->stats;
+	u32 sample_counter;
+	unsigned long irq_flags;
+
 	if (val & MASK_IRQ_STATUS_PREPARED) {
+		atomic_long_inc(&stats->prepare_irqs);
 		PRINT_DEBUG("dma_ng_irq_handler: prepare IRQ\n");
 	}
 	if (val & MASK_IRQ_STATUS_CAPTURE) {
-		if (chip->playback_substream)
-			snd_pcm_period_elapsed(chip->playback_substream);
-		if (chip->capture_substream)
-			snd_pcm_period_elapsed(chip->capture_substream);
+		// the counter read here also serves as the base for the
+		// pointer interpolation until the next page, it is read under
+		// the lock like in clara_pointer()
+		if (chip->pointer_interpolation) {
+			spin_lock_irqsave(&chip->lock, irq_flags);
+			sample_counter = generic_get_sample_counter(chip);
+			generic_store_sample_counter(chip, sample_counter,
+				ktime_get());
+			spin_unlock_irqrestore(&chip->lock, irq_flags);
+		} else
+			sample_counter = generic_get_sample_counter(chip);
+		atomic_long_inc(&stats->period_irqs);
+		update_latency_stats(chip, sample_counter);
+		period_elapsed(&to_dma_ng(chip)->playback);
+		period_elapsed(&to_dma_ng(chip)->capture);
+		start_period_ticks(&to_dma_ng(chip)->playback);
+		start_period_ticks(&to_dma_ng(chip)->capture);
 	}
-	if (!chip->playback_substream && !chip->capture_substream) {
+	spin_lock_irqsave(&chip->lock, irq_flags);
+	if (!generic_configured(chip, SNDRV_PCM_STREAM_PLAYBACK) &&
+		!generic_configured(chip, SNDRV_PCM_STREAM_CAPTURE)) {
+		atomic_long_inc(&stats->dangling_irqs);
 		dma_ng_disable_interrupts(chip);
+		spin_unlock_irqrestore(&chip->lock, irq_flags);
 		PRINT_ERROR("dma_ng_irq_handler: caught dangling IRQ\n");
+	} else
+		spin_unlock_irqrestore(&chip->lock, irq_flags);
+}
+
+irqreturn_t dma_ng_irq_handler(int irq, void *dev_id)
+{
+	struct generic_chip *chip = dev_id;
+	struct dma_ng_stats *stats = &to_dma_ng(chip)->stats;
+	u32 val = generic_get_irq_status(chip);
+	atomic_long_inc(&stats->irqs);
+	if (val == 0) {
+		atomic_long_inc(&stats->spurious_irqs);
+		return IRQ_NONE;
+	}
+	// reading the status acknowledges the IRQ, so in threaded mode we
+	// only need to hand it over to the thread
+	if (chip->irq_threaded) {
+		atomic_or(val, &to_dma_ng(chip)->irq_status);
+		return IRQ_WAKE_THREAD;
+	}
+	handle_irq_status(chip, val);
+	return IRQ_HANDLED;
+}
+
+irqreturn_t dma_ng_irq_thread_handler(int irq, void *dev_id)
+{
+	struct generic_chip *chip = dev_id;
+	struct dma_ng *dma = to_dma_ng(chip);
+
+	// the IRQ thread only exists once the IRQ is requested, so adjust
+	// its priority on the first run
+	if (unlikely(!dma->irq_thread_priority_applied)) {
+		if (chip->irq_thread_priority > 0) {
+			// sched_setscheduler_nocheck() is not exported anymore
+			struct sched_attr attr = {
+				.size = sizeof(attr),
+				.sched_policy = SCHED_FIFO,
+				.sched_priority = chip->irq_thread_priority,
+			};
+			if (sched_setattr_nocheck(current, &attr) < 0)
+				PRINT_WARN("dma_ng_irq_thread_handler: could "
+					"not set priority %d\n",
+					chip->irq_thread_priority);
+		}
+		dma->irq_thread_priority_applied = true;
 	}
+	handle_irq_status(chip, atomic_xchg(&dma->irq_status, 0));
 	return IRQ_HANDLED;
 }
@@ -18,20 +18,103 @@
 #ifndef MARIAN_DMA_NG_H
 #define MARIAN_DMA_NG_H
 
+#include <linux/hrtimer.h>
+#include <linux/bitmap.h>
 #include "device_generic.h"
 
 #define DMA_SAMPLES_PER_BLOCK 16
 #define DMA_BLOCK_SIZE_BYTES (DMA_SAMPLES_PER_BLOCK*4)
-#define DMA_NUM_PERIODS 2
+// the engine splits the block ring into two pages and raises one IRQ
+// per page
+#define DMA_NUM_PAGES 2
+#define DMA_MIN_NUM_PERIODS DMA_NUM_PAGES
+#define DMA_MAX_NUM_PERIODS 32
 #define DMA_MAX_NUM_BLOCKS 1024
+// configuration registers of BAR0 and BAR1 that are mirrored in the shadow
+// cache, BAR1 registers are indexed by their 4k page
+#define DMA_NG_BAR0_SHADOW_REGS (0x400 / 4)
+#define DMA_NG_BAR1_SHADOW_REGS 3
+// to make things not too complicated, we fix the number of channels per slice
+#define NUM_CHANNEL_ENABLE_REGS 16
 
+/* Written without locking, each counter only has a single writer (either the
+ * hard IRQ handler, the IRQ thread or the period timer). */
+struct dma_ng_stats {
+	atomic_long_t irqs;
+	atomic_long_t spurious_irqs;
+	atomic_long_t prepare_irqs;
+	atomic_long_t period_irqs;
+	atomic_long_t dangling_irqs;
+	atomic_long_t period_ticks;
+	// time from the page boundary until the periods are signalled
+	atomic_long_t latency_sum_ns;
+	unsigned long latency_min_ns;
+	unsigned long latency_max_ns;
+};
+
+/* Configuration and period signalling of one direction. The channel
+ * configuration is kept while the direction is disabled, so the direction
+ * can join a running engine later on. Both directions share the block ring
+ * but may split it into a different number of periods. If a page holds more
+ * than one period, the periods in between two page IRQs are signalled by the
+ * period timer of the direction. */
+struct dma_ng_direction {
+	struct generic_chip *chip;
+	bool playback;
+	struct hrtimer period_timer;
+	// used in critical sections start
+	ktime_t period_time;
+	unsigned int periods_per_page;
+	unsigned int pending_period_ticks;
+	u32 channel_enables[NUM_CHANNEL_ENABLE_REGS];
+	// number of enabled (packed) channels, kept as well
+	unsigned int slice_channels;
+	bool enabled;
+	// used in critical sections end
+};
+
+// engine state that is not kept in the FPGA itself
+struct dma_ng {
+	struct generic_chip *chip;
+	// status handed over from the hard IRQ handler in threaded mode
+	atomic_t irq_status;
+	bool irq_thread_priority_applied;
+	struct dma_ng_stats stats;
+	struct dma_ng_direction playback;
+	struct dma_ng_direction capture;
+	// used in critical sections start
+	// duration of one page of the block ring, i.e. the IRQ interval
+	ktime_t page_time;
+	bool interrupts_enabled;
+	// value of the slice register shared by both directions
+	unsigned int slice_channels;
+	// last values written to the configuration registers, so writes
+	// that would not change anything can be skipped
+	u32 bar0_shadow[DMA_NG_BAR0_SHADOW_REGS];
+	DECLARE_BITMAP(bar0_shadow_valid, DMA_NG_BAR0_SHADOW_REGS);
+	u32 bar1_shadow[DMA_NG_BAR1_SHADOW_REGS];
+	DECLARE_BITMAP(bar1_shadow_valid, DMA_NG_BAR1_SHADOW_REGS);
+	// used in critical sections end
+};
+
+void dma_ng_init(struct generic_chip *chip);
+void dma_ng_free(struct generic_chip *chip);
 irqreturn_t dma_ng_irq_handler(int irq, void *dev_id);
-int dma_ng_prepare(struct generic_chip *chip, unsigned int channels,
-	bool playback, u64 host_base_addr, unsigned int num_blocks,
-	unsigned int channels_per_dma_slice);
+irqreturn_t dma_ng_irq_thread_handler(int irq, void *dev_id);
+// channel_enables_map holds one bit per hardware channel
+// (GENERIC_MAX_NUM_CHANNELS bits)
+int dma_ng_prepare(struct generic_chip *chip,
+	unsigned long const *channel_enables_map, bool playback,
+	u64 host_base_addr, unsigned int num_blocks, unsigned int num_periods,
+	unsigned int max_channels_per_dma_slice);
+int dma_ng_arm(struct generic_chip *chip);
+int dma_ng_release(struct generic_chip *chip);
 int dma_ng_start(struct generic_chip *chip);
 int dma_ng_stop(struct generic_chip *chip);
 int dma_ng_disable_interrupts(struct generic_chip *chip);
+int dma_ng_update_interrupts(struct generic_chip *chip);
+int dma_ng_enable_channels(struct generic_chip *chip, bool playback);
 int dma_ng_disable_channels(struct generic_chip *chip, bool playback);
+void dma_ng_sync_period_ticks(struct generic_chip *chip);
 
 #endif
@@ -22,6 +22,12 @@
 #include <linux/slab.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/sched.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/freezer.h>
+#include <linux/ktime.h>
 #include <sound/core.h>
 #include <sound/memalloc.h>
 #include <sound/initval.h>
@@ -37,40 +43,309 @@ MODULE_LICENSE("GPL v2");
 __maybe_unused static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
 __maybe_unused static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
 __maybe_unused static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP;
+__maybe_unused static char *irq_cpus[SNDRV_CARDS];
+__maybe_unused static char *timer_cpus[SNDRV_CARDS];
+__maybe_unused static unsigned int playback_transport_frames[SNDRV_CARDS];
+__maybe_unused static unsigned int capture_transport_frames[SNDRV_CARDS];
+
+static bool threaded_irq = false;
+static int irq_thread_priority = 0;
+static bool pointer_interpolation = false;
+static bool aggregate = false;
+static unsigned int num_subdevices = 1;
+static unsigned int dma_prealloc_kb = 0;
+static unsigned int playback_dma_type = GENERIC_DMA_TYPE_AUTO;
+static unsigned int capture_dma_type = GENERIC_DMA_TYPE_AUTO;
+static bool dma_benchmark = false;
+static unsigned int rate_check_ms = 10;
+static unsigned int timer_interval_ms = 0;
 
-static unsigned dev_idx = 0;
+static struct pci_device_id pci_ids[] = {
+	{ PCI_DEVICE(MARIAN_VENDOR_ID, CLARA_E_DEVICE_ID) },
+	{ PCI_DEVICE(MARIAN_VENDOR_ID, CLARA_EMIN_DEVICE_ID) },
+	{ 0, }
+};
+MODULE_DEVICE_TABLE(pci, pci_ids);
+
+/* Each card takes the slot of the card parameters given by its PCI address
+ * among the cards of the driver, or the first free one if that is taken.
+ * Cards are probed in parallel, so the slots are handed out under a mutex.
+ * A disabled card keeps its slot, a card that failed to probe gives it
+ * back. */
+static DEFINE_MUTEX(dev_mutex);
+static DECLARE_BITMAP(dev_used, SNDRV_CARDS);
 
 MODULE_PARM_DESC(index, "Index value for MARIAN soundcard.");
 MODULE_PARM_DESC(id, "ID string for MARIAN soundcard.");
 MODULE_PARM_DESC(enable, "Enable MARIAN soundcard.");
+MODULE_PARM_DESC(irq_cpus,
+	"CPU list (e.g. 0-7) the IRQ of each MARIAN soundcard is directed to, "
+	"default: no restriction.");
+MODULE_PARM_DESC(timer_cpus,
+	"CPU list the timer thread may run on for each MARIAN soundcard, "
+	"default: no restriction.");
+MODULE_PARM_DESC(playback_transport_frames,
+	"Measured playback delay inside each MARIAN soundcard in frames, added "
+	"to the reported delay (default: 0).");
+MODULE_PARM_DESC(capture_transport_frames,
+	"Measured capture delay inside each MARIAN soundcard in frames, added "
+	"to the reported delay (default: 0).");
+MODULE_PARM_DESC(threaded_irq,
+	"Process periods in an IRQ thread instead of the hard IRQ handler.");
+MODULE_PARM_DESC(irq_thread_priority,
+	"SCHED_FIFO priority of the IRQ thread (1-99, 0: kernel default).");
+MODULE_PARM_DESC(pointer_interpolation,
+	"Estimate the DMA position between IRQs instead of reading it from "
+	"the card.");
+MODULE_PARM_DESC(num_subdevices,
+	"Number of PCM subdevices per direction, each bound to its own range "
+	"of channels (1-8).");
+MODULE_PARM_DESC(aggregate,
+	"Provide an additional PCM on the first card covering the channels of "
+	"all cards.");
+MODULE_PARM_DESC(dma_prealloc_kb,
+	"Size of the DMA buffer per direction allocated at probe in kB, "
+	"0: allocate the buffers when a PCM is configured.");
+MODULE_PARM_DESC(playback_dma_type,
+	"Memory type of the playback DMA buffers (0: auto, 1: coherent, "
+	"2: write-combining, 3: non-coherent).");
+MODULE_PARM_DESC(capture_dma_type,
+	"Memory type of the capture DMA buffers (0: auto, 1: coherent, "
+	"2: write-combining, 3: non-coherent).");
+MODULE_PARM_DESC(dma_benchmark,
+	"Measure the CPU write and read throughput of each DMA buffer when it "
+	"is attached to a PCM, shown in /proc/asound/cardN/dma_buffers.");
+MODULE_PARM_DESC(rate_check_ms,
+	"Interval in ms the sample rate is checked at, rounded up to jiffies; "
+	"running streams are stopped when the card reports a new rate "
+	"(default 10, 0: only by the timer thread).");
+MODULE_PARM_DESC(timer_interval_ms,
+	"Interval in ms of the maintenance of each card by the timer thread "
+	"(0: default of the card).");
 
 module_param_array(index, int, NULL, 0444);
 module_param_array(id, charp, NULL, 0444);
 module_param_array(enable, bool, NULL, 0444);
+module_param_array(irq_cpus, charp, NULL, 0444);
+module_param_array(timer_cpus, charp, NULL, 0444);
+module_param_array(playback_transport_frames, uint, NULL, 0444);
+module_param_array(capture_transport_frames, uint, NULL, 0444);
+module_param(threaded_irq, bool, 0444);
+module_param(irq_thread_priority, int, 0444);
+module_param(pointer_interpolation, bool, 0444);
+module_param(num_subdevices, uint, 0444);
+module_param(aggregate, bool, 0444);
+module_param(dma_prealloc_kb, uint, 0444);
+module_param(playback_dma_type, uint, 0444);
+module_param(capture_dma_type, uint, 0444);
+module_param(dma_benchmark, bool, 0444);
+module_param(rate_check_ms, uint, 0444);
+module_param(timer_interval_ms, uint, 0444);
+
+/* One timer thread does the maintenance of all cards. It is not running in
+the context of the interrupt handler so it is safe to do things like sleeping
+or allocating memory. It might also not be very precise in timing.
+The callbacks of all cards that are due are run in one pass, cards due within
+half of their interval are taken along, so the cards end up being maintained
+together instead of waking up the thread one after the other. */
+static DEFINE_MUTEX(timer_mutex);
+static LIST_HEAD(timer_chips);
+static DECLARE_WAIT_QUEUE_HEAD(timer_wait);
+static struct task_struct *timer_thread;
+static bool timer_kicked;
+
+// the caller needs to hold timer_mutex
+static long timer_pass(void)
+{
+	struct generic_chip *chip = NULL;
+	unsigned long next = 0;
+	bool any = false;
+
+	list_for_each_entry(chip, &timer_chips, timer_entry) {
+		unsigned long const interval =
+			msecs_to_jiffies(chip->timer_interval_ms);
+		if (time_before_eq(chip->timer_due, jiffies + interval / 2)) {
+			chip->timer_callback(chip);
+			chip->timer_due = jiffies + interval;
+		}
+		if (!any || time_before(chip->timer_due, next))
+			next = chip->timer_due;
+		any = true;
+	}
+	if (!any)
+		return MAX_SCHEDULE_TIMEOUT;
+	return time_before(jiffies, next) ? (long)(next - jiffies) : 1;
+}
 
-/* each device starts a timer thread for maintenance tasks
-the thread is not running in the context of the interrupt handler
-so it is safe to do things like sleeping or allocating memory.
-It might also not be very precise in timing.*/
 static int timer_thread_func(void *data)
 {
-	struct generic_chip *chip = data;
-	long int start = 0;
-	long int end = 0;
+	long timeout = 0;
 	PRINT_DEBUG("timer thread started\n");
-	while(!kthread_should_stop()) {
-		start = jiffies;
-		chip->timer_callback(chip);
-		end = jiffies;
-		msleep(max((signed long)(chip->timer_interval_ms) -
-			jiffies_to_msecs(end - start), (signed long)1));
+	set_freezable();
+	while (!kthread_should_stop()) {
+		mutex_lock(&timer_mutex);
+		timer_kicked = false;
+		timeout = timer_pass();
+		mutex_unlock(&timer_mutex);
+		wait_event_freezable_timeout(timer_wait,
+			kthread_should_stop() || READ_ONCE(timer_kicked),
+			timeout);
 	}
 	PRINT_DEBUG("timer thread stopped\n");
 	return 0;
 }
 
-static int driver_probe(struct pci_dev *pci_dev,
-	struct pci_device_id const *pci_id)
+/* The thread may run on the CPUs of all cards, a card without timer_cpus
+ * allows all of them.
+ * The caller needs to hold timer_mutex. */
+static void timer_update_affinity(void)
+{
+	struct generic_chip *chip = NULL;
+	cpumask_var_t cpus;
+
+	if (timer_thread == NULL || !zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return;
+	list_for_each_entry(chip, &timer_chips, timer_entry) {
+		if (!chip->timer_affinity_set) {
+			cpumask_copy(cpus, cpu_possible_mask);
+			break;
+		}
+		cpumask_or(cpus, cpus, &chip->timer_affinity);
+	}
+	if (!cpumask_empty(cpus))
+		set_cpus_allowed_ptr(timer_thread, cpus);
+	free_cpumask_var(cpus);
+}
+
+/* Adds the card to the timer thread, which is started with the first card.
+ * The callback of the card is run right away. */
+static int timer_add_chip(struct generic_chip *chip)
+{
+	int err = 0;
+
+	mutex_lock(&timer_mutex);
+	if (timer_thread == NULL) {
+		struct task_struct *thread = kthread_create_on_node(
+			timer_thread_func, NULL,
+			dev_to_node(&chip->pci_dev->dev),
+			"MARIAN_timer_thread");
+		if (IS_ERR(thread)) {
+			err = PTR_ERR(thread);
+			goto unlock;
+		}
+		timer_thread = thread;
+		wake_up_process(thread);
+	}
+	chip->timer_due = jiffies;
+	list_add_tail(&chip->timer_entry, &timer_chips);
+	timer_update_affinity();
+	timer_kicked = true;
+	wake_up(&timer_wait);
+unlock:
+	mutex_unlock(&timer_mutex);
+	return err;
+}
+
+/* Removes the card from the timer thread, its callback is not running
+ * anymore afterwards. The thread is stopped with the last card. */
+static void timer_remove_chip(struct generic_chip *chip)
+{
+	struct task_struct *thread = NULL;
+
+	mutex_lock(&timer_mutex);
+	if (list_empty(&chip->timer_entry))
+		goto unlock;
+	list_del_init(&chip->timer_entry);
+	if (list_empty(&timer_chips)) {
+		thread = timer_thread;
+		timer_thread = NULL;
+	} else
+		timer_update_affinity();
+unlock:
+	mutex_unlock(&timer_mutex);
+	// the thread takes timer_mutex, so it is stopped after releasing it
+	if (thread)
+		kthread_stop(thread);
+}
+
+/* Returns the CPUs given by a CPU list parameter of the card. Returns false
+ * if there is none, the placement is then left to the kernel and irqbalance. */
+static bool card_cpus(char const *list, char const *param,
+	struct cpumask *rmask)
+{
+	if (list == NULL || *list == '\0')
+		return false;
+	if (cpulist_parse(list, rmask) == 0 &&
+		cpumask_intersects(rmask, cpu_online_mask))
+		return true;
+	PRINT_WARN("MARIAN driver probe: ignoring %s=%s\n", param, list);
+	return false;
+}
+
+static bool pci_address_before(struct pci_dev *a, struct pci_dev *b)
+{
+	int const domain_a = pci_domain_nr(a->bus);
+	int const domain_b = pci_domain_nr(b->bus);
+
+	if (domain_a != domain_b)
+		return domain_a < domain_b;
+	if (a->bus->number != b->bus->number)
+		return a->bus->number < b->bus->number;
+	return a->devfn < b->devfn;
+}
+
+// number of cards of the driver at a lower PCI address
+static int pci_rank(struct pci_dev *pci_dev)
+{
+	struct pci_dev *other = NULL;
+	int rank = 0;
+
+	while ((other = pci_get_device(MARIAN_VENDOR_ID, PCI_ANY_ID,
+		other)) != NULL) {
+		if (pci_match_id(pci_ids, other) != NULL &&
+			pci_address_before(other, pci_dev))
+			rank++;
+	}
+	return rank;
+}
+
+static int claim_dev_idx(struct pci_dev *pci_dev)
+{
+	int dev_idx = pci_rank(pci_dev);
+
+	mutex_lock(&dev_mutex);
+	if (dev_idx >= SNDRV_CARDS || test_bit(dev_idx, dev_used))
+		dev_idx = find_first_zero_bit(dev_used, SNDRV_CARDS);
+	if (dev_idx < SNDRV_CARDS)
+		set_bit(dev_idx, dev_used);
+	else
+		dev_idx = -ENODEV;
+	mutex_unlock(&dev_mutex);
+	return dev_idx;
+}
+
+/* Position of the card among the enabled slots, which does not depend on the
+ * order the cards are probed in once the slots are taken. */
+static unsigned int enabled_position(int dev_idx)
+{
+	unsigned int position = 0;
+	int i = 0;
+
+	for (i = 0; i < dev_idx; i++)
+		if (enable[i])
+			position++;
+	return position;
+}
+
+static void release_dev_idx(int dev_idx)
+{
+	mutex_lock(&dev_mutex);
+	clear_bit(dev_idx, dev_used);
+	mutex_unlock(&dev_mutex);
+}
+
+static int probe_card(struct pci_dev *pci_dev,
+	struct pci_device_id const *pci_id, int dev_idx)
 {
 	struct snd_card *card = NULL;
 	struct generic_chip *chip = NULL;
@@ -79,15 +354,7 @@ static int driver_probe(struct pci_dev *pci_dev,
 	};
 	int err = 0;
 	struct device_specifics dev_specifics;
-
-	if (dev_idx >= SNDRV_CARDS) {
-		return -ENODEV;
-	}
-
-	if (!enable[dev_idx]) {
-		dev_idx++;
-		return -ENOENT;
-	}
+	__maybe_unused ktime_t const start = ktime_get();
 
 	PRINT_INFO("MARIAN driver probe: Driver version: %s\n",
 		MARIAN_DRIVER_VERSION_STRING);
@@ -153,34 +420,46 @@ static int driver_probe(struct pci_dev *pci_dev,
 	// prevent something funny happens when the irq handler is attached
 	dev_specifics.soft_reset(chip);
 
-	if (request_irq(chip->pci_dev->irq,
+	if (threaded_irq && dev_specifics.irq_thread_handler == NULL)
+		PRINT_WARN("MARIAN driver probe: threaded IRQ not supported, "
+			"falling back to hard IRQ handler\n");
+	chip->irq_threaded = threaded_irq &&
+		dev_specifics.irq_thread_handler != NULL;
+	chip->irq_thread_priority = clamp(irq_thread_priority, 0, 99);
+	chip->pointer_interpolation = pointer_interpolation;
+	chip->playback_transport_frames = playback_transport_frames[dev_idx];
+	chip->capture_transport_frames = capture_transport_frames[dev_idx];
+	generic_set_num_subdevices(chip, num_subdevices);
+	if (request_threaded_irq(pci_irq_vector(chip->pci_dev, 0),
 		dev_specifics.irq_handler,
-		chip->pci_dev->msi_enabled ? 0 : IRQF_SHARED,
+		chip->irq_threaded ? dev_specifics.irq_thread_handler : NULL,
+		pci_dev_msi_enabled(chip->pci_dev) ? 0 : IRQF_SHARED,
 		KBUILD_MODNAME,
 		chip) < 0) {
-		PRINT_ERROR("request_irq error: %d\n", chip->pci_dev->irq);
+		PRINT_ERROR("request_irq error: %d\n",
+			pci_irq_vector(chip->pci_dev, 0));
 		err = -ENXIO;
 		goto error_free_chip;
 	}
-	chip->irq = chip->pci_dev->irq;
+	chip->irq = pci_irq_vector(chip->pci_dev, 0);
 	card->sync_irq = chip->irq;
 	PRINT_DEBUG("MARIAN driver probe: IRQ: %d\n", chip->irq);
+	if (card_cpus(irq_cpus[dev_idx], "irq_cpus", &chip->irq_affinity))
+		generic_set_irq_affinity(chip);
 
 	// create a sound device
 	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, chip, &ops);
 	if (err < 0)
 		goto error_free_card;
 
-	if (dev_specifics.alloc_dma_buffers(pci_dev, chip) < 0) {
-		PRINT_ERROR(
-			"failed to allocate DMA buffers\n");
-		err = -ENOMEM;
-		goto error_free_card;
-	}
+	chip->dma_prealloc_bytes = (size_t)dma_prealloc_kb * 1024;
+	generic_set_dma_types(chip, playback_dma_type, capture_dma_type);
+	chip->dma_benchmark = dma_benchmark;
 
 	{ // create a PCM device
 		struct snd_pcm *pcm;
-		err = snd_pcm_new(card, card->shortname, 0, 1, 1, &pcm);
+		err = snd_pcm_new(card, card->shortname, 0,
+			chip->num_subdevices, chip->num_subdevices, &pcm);
 		if (err < 0)
 			goto error_free_card;
 		pcm->private_data = chip;
@@ -192,19 +471,13 @@ static int driver_probe(struct pci_dev *pci_dev,
 			dev_specifics.pcm_capture_ops);
 	}
 
-	// map wordclock measurement function
-	// make sure this is done before setting up the timer callback!
-	chip->measure_wordclock_hz = dev_specifics.measure_wordclock_hz;
-
-	// setup timer thread
-	chip->timer_interval_ms = dev_specifics.timer_interval_ms;
-	chip->timer_callback = dev_specifics.timer_callback;
-	chip->timer_thread = kthread_run(timer_thread_func,
-		(void *)chip, "MARIAN_timer_thread");
-	if (IS_ERR(chip->timer_thread)) {
-		PRINT_ERROR("could not create timer thread\n");
-		err = -ENOMEM;
-		goto error_free_card;
+	// join the aggregate PCM, it may be created on this card
+	if (aggregate && dev_specifics.join_aggregate) {
+		err = dev_specifics.join_aggregate(chip,
+			enabled_position(dev_idx));
+		if (err < 0)
+			goto error_free_card;
+		chip->leave_aggregate = dev_specifics.leave_aggregate;
 	}
 
 	// create controls
@@ -212,15 +485,50 @@ static int driver_probe(struct pci_dev *pci_dev,
 	if (err < 0)
 		goto error_free_card;
 
+	// map wordclock measurement function
+	// make sure this is done before setting up the timer callback!
+	chip->measure_wordclock_hz = dev_specifics.measure_wordclock_hz;
+	// measure the sample rate once, so the PCMs can be opened as soon as
+	// the card is registered
+	generic_check_sample_rate(chip, false);
+
 	// register as ALSA device
 	err = snd_card_register(card);
 	if (err < 0)
 		goto error_free_card;
+	PRINT_INFO("MARIAN driver probe: %s registered after %lld us\n",
+		card->shortname, ktime_us_delta(ktime_get(), start));
+
+	// the rest may take a while and is not needed to register the card,
+	// the buffers are allocated in hw_params if there is no preallocation
+	mutex_lock(&chip->buffer_mutex);
+	err = dev_specifics.alloc_dma_buffers(pci_dev, chip);
+	mutex_unlock(&chip->buffer_mutex);
+	if (err < 0)
+		PRINT_WARN("failed to preallocate DMA buffers, "
+			"allocating them on demand\n");
+
+	// hand the card to the timer thread
+	chip->timer_interval_ms = timer_interval_ms ? timer_interval_ms :
+		dev_specifics.timer_interval_ms;
+	chip->timer_callback = dev_specifics.timer_callback;
+	chip->timer_affinity_set = card_cpus(timer_cpus[dev_idx], "timer_cpus",
+		&chip->timer_affinity);
+	err = timer_add_chip(chip);
+	if (err < 0) {
+		PRINT_ERROR("could not create timer thread\n");
+		goto error_free_card;
+	}
+
+	// watch the sample rate, needs the sample rate control to notify
+	chip->sample_rate_changed = dev_specifics.sample_rate_changed;
+	chip->get_clock_mode = dev_specifics.get_clock_mode;
+	generic_start_rate_monitor(chip, rate_check_ms);
 
-	PRINT_INFO("MARIAN driver probe: Initialized module for %s\n",
-		dev_specifics.card_name);
+	PRINT_INFO("MARIAN driver probe: Initialized module for %s "
+		"after %lld us\n", dev_specifics.card_name,
+		ktime_us_delta(ktime_get(), start));
 	dev_specifics.indicate_state(chip, STATE_SUCCESS);
-	dev_idx++;
 	return 0;
 
 // up until snd_device_new() is called we need to explicitely clean up the chip
@@ -235,13 +543,33 @@ error_free_chip:
 error_free_card:
 	if (chip)
 		dev_specifics.indicate_state(chip, STATE_FAILURE);
-	if (chip && chip->timer_thread)
-		kthread_stop(chip->timer_thread);
+	if (chip)
+		generic_stop_rate_monitor(chip);
+	if (chip)
+		timer_remove_chip(chip);
+	if (chip && chip->leave_aggregate)
+		chip->leave_aggregate(chip);
 	snd_card_free(card);
 	pci_set_drvdata(pci_dev, NULL);
 	return err;
 }
 
+static int driver_probe(struct pci_dev *pci_dev,
+	struct pci_device_id const *pci_id)
+{
+	int const dev_idx = claim_dev_idx(pci_dev);
+	int err = 0;
+
+	if (dev_idx < 0)
+		return dev_idx;
+	if (!enable[dev_idx])
+		return -ENOENT;
+	err = probe_card(pci_dev, pci_id, dev_idx);
+	if (err < 0)
+		release_dev_idx(dev_idx);
+	return err;
+}
+
 static void driver_remove(struct pci_dev *pci)
 {
 	struct snd_card *card = pci_get_drvdata(pci);
@@ -256,25 +584,27 @@ static void driver_remove(struct pci_dev *pci)
 		// device specific functions anymore
 		if (chip)
 			generic_indicate_state(chip, STATE_RESET);
-		if (chip && chip->timer_thread)
-			kthread_stop(chip->timer_thread);
+		if (chip)
+			generic_stop_rate_monitor(chip);
+		if (chip)
+			timer_remove_chip(chip);
+		if (chip && chip->leave_aggregate)
+			chip->leave_aggregate(chip);
 		snd_card_free(card);
 		pci_set_drvdata(pci, NULL);
 	}
 }
 
-static struct pci_device_id pci_ids[] = {
-	{ PCI_DEVICE(MARIAN_VENDOR_ID, CLARA_E_DEVICE_ID) },
-	{ PCI_DEVICE(MARIAN_VENDOR_ID, CLARA_EMIN_DEVICE_ID) },
-	{ 0, }
-};
-MODULE_DEVICE_TABLE(pci, pci_ids);
-
 static struct pci_driver pci_driver = {
 	.name = KBUILD_MODNAME,
 	.id_table = pci_ids,
 	.probe = driver_probe,
 	.remove = driver_remove,
+	.driver = {
+		// cards do not depend on each other, probing them in parallel
+		// does not hold up the boot
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+	},
 };
 
 module_pci_driver(pci_driver);
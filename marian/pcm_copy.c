@@ -0,0 +1,714 @@
+/*
+ * MARIAN PCIe soundcards ALSA driver
+ *
+ * Author: Tobias Groß <theguy@audio-fpga.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <sound/core.h>
+#include <sound/pcm.h>
+#include <sound/pcm_params.h>
+#if defined(CONFIG_X86_64)
+#include <asm/fpu/api.h>
+#include <asm/simd.h>
+#define PCM_COPY_SIMD
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON) && \
+	!defined(CONFIG_CPU_BIG_ENDIAN)
+#include <asm/neon.h>
+#include <asm/simd.h>
+#define PCM_COPY_SIMD
+#endif
+#include "dbg_out.h"
+#include "device_generic.h"
+#include "pcm_copy.h"
+
+// the application side of a transfer, which depends on the kernel version
+struct copy_io {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	struct iov_iter *iter;
+#else
+	void __user *ubuf;
+	void *kbuf;
+#endif
+};
+
+static int io_read(struct copy_io *io, void *to, size_t bytes)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	if (copy_from_iter(to, bytes, io->iter) != bytes)
+		return -EFAULT;
+#else
+	if (io->kbuf) {
+		memcpy(to, io->kbuf, bytes);
+		io->kbuf += bytes;
+	} else {
+		if (copy_from_user(to, io->ubuf, bytes))
+			return -EFAULT;
+		io->ubuf += bytes;
+	}
+#endif
+	return 0;
+}
+
+static int io_write(struct copy_io *io, void const *from, size_t bytes)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+	if (copy_to_iter(from, bytes, io->iter) != bytes)
+		return -EFAULT;
+#else
+	if (io->kbuf) {
+		memcpy(io->kbuf, from, bytes);
+		io->kbuf += bytes;
+	} else {
+		if (copy_to_user(io->ubuf, from, bytes))
+			return -EFAULT;
+		io->ubuf += bytes;
+	}
+#endif
+	return 0;
+}
+
+static void private_free(struct snd_pcm_runtime *runtime)
+{
+	struct pcm_copy *copy = runtime->private_data;
+
+	if (copy != NULL) {
+		kfree(copy->bounce);
+		kfree(copy);
+	}
+	runtime->private_data = NULL;
+}
+
+// mmap access exposes the DMA buffer, which only holds 32 bit samples
+static int rule_format(struct snd_pcm_hw_params *params,
+	struct snd_pcm_hw_rule *rule)
+{
+	struct snd_mask *access = hw_param_mask(params,
+		SNDRV_PCM_HW_PARAM_ACCESS);
+	struct snd_mask *format = hw_param_mask(params,
+		SNDRV_PCM_HW_PARAM_FORMAT);
+	struct snd_mask allowed;
+
+	if (snd_mask_test(access,
+			(__force unsigned int)SNDRV_PCM_ACCESS_RW_INTERLEAVED) ||
+		snd_mask_test(access,
+			(__force unsigned int)SNDRV_PCM_ACCESS_RW_NONINTERLEAVED))
+		return 0;
+	snd_mask_none(&allowed);
+	snd_mask_set_format(&allowed, SNDRV_PCM_FORMAT_S32_LE);
+	return snd_mask_refine(format, &allowed);
+}
+
+static int rule_access(struct snd_pcm_hw_params *params,
+	struct snd_pcm_hw_rule *rule)
+{
+	struct snd_mask *access = hw_param_mask(params,
+		SNDRV_PCM_HW_PARAM_ACCESS);
+	struct snd_mask *format = hw_param_mask(params,
+		SNDRV_PCM_HW_PARAM_FORMAT);
+	struct snd_mask allowed;
+
+	if (snd_mask_test_format(format, SNDRV_PCM_FORMAT_S32_LE))
+		return 0;
+	snd_mask_none(&allowed);
+	snd_mask_set(&allowed,
+		(__force unsigned int)SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+	snd_mask_set(&allowed,
+		(__force unsigned int)SNDRV_PCM_ACCESS_RW_NONINTERLEAVED);
+	return snd_mask_refine(access, &allowed);
+}
+
+/* buffer_bytes_max of the hardware limits the DMA buffer, in which a sample
+ * takes 32 bits whatever the format of the application is. */
+static int rule_buffer_size(struct snd_pcm_hw_params *params,
+	struct snd_pcm_hw_rule *rule)
+{
+	struct snd_pcm_runtime *runtime = rule->private;
+	struct snd_interval *channels = hw_param_interval(params,
+		SNDRV_PCM_HW_PARAM_CHANNELS);
+	struct snd_interval frames;
+
+	if (channels->min == 0)
+		return 0;
+	snd_interval_any(&frames);
+	frames.max = runtime->hw.buffer_bytes_max /
+		(channels->min * sizeof(u32));
+	frames.integer = 1;
+	return snd_interval_refine(hw_param_interval(params,
+		SNDRV_PCM_HW_PARAM_BUFFER_SIZE), &frames);
+}
+
+/* Needs to be called by the open callback once runtime->hw is set up.
+ * The state is released together with the runtime. */
+int pcm_copy_open(struct snd_pcm_substream *substream,
+	unsigned int first_channel)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct pcm_copy *copy = NULL;
+	// the bounce buffer is copied to and from the DMA buffer
+	int const node = dev_to_node(substream->pcm->card->dev);
+	int err = 0;
+
+	copy = kzalloc_node(sizeof(*copy), GFP_KERNEL, node);
+	if (copy == NULL)
+		return -ENOMEM;
+	copy->first_channel = first_channel;
+	// at least one frame has to fit
+	copy->bounce_bytes = max_t(size_t, PCM_COPY_BOUNCE_BYTES,
+		runtime->hw.channels_max * sizeof(u32));
+	copy->bounce = kmalloc_node(copy->bounce_bytes, GFP_KERNEL, node);
+	if (copy->bounce == NULL) {
+		kfree(copy);
+		return -ENOMEM;
+	}
+	runtime->private_data = copy;
+	runtime->private_free = private_free;
+
+	// the byte limits of the hardware count 32 bit samples, the period
+	// size itself is constrained in frames by the card
+	runtime->hw.period_bytes_min = runtime->hw.period_bytes_min *
+		PCM_COPY_MIN_SAMPLE_BYTES / sizeof(u32);
+
+	// the DMA buffer itself is never interleaved
+	err = snd_pcm_hw_constraint_mask64(runtime, SNDRV_PCM_HW_PARAM_ACCESS,
+		(1ULL << (__force int)SNDRV_PCM_ACCESS_MMAP_NONINTERLEAVED) |
+		(1ULL << (__force int)SNDRV_PCM_ACCESS_RW_NONINTERLEAVED) |
+		(1ULL << (__force int)SNDRV_PCM_ACCESS_RW_INTERLEAVED));
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_FORMAT,
+		rule_format, NULL, SNDRV_PCM_HW_PARAM_ACCESS, -1);
+	if (err < 0)
+		return err;
+	err = snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_ACCESS,
+		rule_access, NULL, SNDRV_PCM_HW_PARAM_FORMAT, -1);
+	if (err < 0)
+		return err;
+	return snd_pcm_hw_rule_add(runtime, 0, SNDRV_PCM_HW_PARAM_BUFFER_SIZE,
+		rule_buffer_size, runtime, SNDRV_PCM_HW_PARAM_CHANNELS, -1);
+}
+
+static u32 *channel_area(struct snd_pcm_runtime *runtime,
+	unsigned int channel)
+{
+	struct pcm_copy *copy = runtime->private_data;
+
+	return (u32 *)runtime->dma_area +
+		(size_t)(copy->first_channel + channel) * runtime->buffer_size;
+}
+
+/* Conversion of single samples between the application format and the
+ * 32 bit samples of the DMA buffer. src and dst are at least aligned to the
+ * size of the application sample, except for the packed 24 bit format. */
+static inline u32 load_s32(u8 const *src)
+{
+	return le32_to_cpu(*(__le32 const *)src);
+}
+
+static inline void store_s32(u8 *dst, u32 sample)
+{
+	*(__le32 *)dst = cpu_to_le32(sample);
+}
+
+static inline u32 load_s16(u8 const *src)
+{
+	return (u32)le16_to_cpu(*(__le16 const *)src) << 16;
+}
+
+static inline void store_s16(u8 *dst, u32 sample)
+{
+	*(__le16 *)dst = cpu_to_le16(sample >> 16);
+}
+
+static inline u32 load_s24_3(u8 const *src)
+{
+	return ((u32)src[0] << 8) | ((u32)src[1] << 16) | ((u32)src[2] << 24);
+}
+
+static inline void store_s24_3(u8 *dst, u32 sample)
+{
+	dst[0] = sample >> 8;
+	dst[1] = sample >> 16;
+	dst[2] = sample >> 24;
+}
+
+/* Floating point registers must not be used here, so the IEEE 754 single
+ * precision samples are converted by taking them apart. Values outside of
+ * [-1.0, 1.0) are clipped, NaN becomes silence. */
+static inline u32 load_float(u8 const *src)
+{
+	u32 const bits = le32_to_cpu(*(__le32 const *)src);
+	int const exponent = (bits >> 23) & 0xff;
+	u32 const mantissa = (bits & 0x7fffff) | 0x800000;
+	u32 value = 0;
+
+	if (exponent >= 127) {
+		if (exponent == 255 && (bits & 0x7fffff))
+			return 0;
+		return (bits & 0x80000000) ? 0x80000000 : 0x7fffffff;
+	}
+	// mantissa * 2^(exponent - 150) scaled by 2^31
+	if (exponent >= 119)
+		value = mantissa << (exponent - 119);
+	else if (exponent > 119 - 24)
+		value = mantissa >> (119 - exponent);
+	return (bits & 0x80000000) ? -value : value;
+}
+
+static inline void store_float(u8 *dst, u32 sample)
+{
+	u32 const sign = sample & 0x80000000;
+	u32 const value = sign ? -sample : sample;
+	u32 bits = 0;
+	int msb = 0;
+
+	if (value != 0) {
+		msb = fls(value) - 1;
+		// value * 2^-31 with 24 significant bits
+		if (msb > 23)
+			bits = (value >> (msb - 23)) & 0x7fffff;
+		else
+			bits = (value << (23 - msb)) & 0x7fffff;
+		bits |= sign | (u32)(msb + 96) << 23;
+	}
+	*(__le32 *)dst = cpu_to_le32(bits);
+}
+
+/* Generates the loops of one application format, so that the conversion is
+ * inlined into them.
+ *
+ * Interleaved frames are transposed in tiles of PCM_COPY_TILE_FRAMES frames
+ * by PCM_COPY_TILE_CHANNELS channels. The frames of a tile are read (or
+ * written) one cache line each, the channels of a tile one cache line each,
+ * so both sides of the transpose stay in the cache while the tile is
+ * processed. S32_LE frames, which need no conversion, are transposed with
+ * SIMD instead where available, see transpose_s32(). */
+#define DEFINE_SAMPLE_FORMAT(name, size) \
+static void deinterleave_##name(struct snd_pcm_runtime *runtime, \
+	u8 const *src, unsigned int frame, unsigned int frames) \
+{ \
+	unsigned int const channels = runtime->channels; \
+	size_t const stride = channels * (size); \
+	unsigned int tf = 0; \
+	unsigned int tc = 0; \
+	unsigned int c = 0; \
+	unsigned int f = 0; \
+ \
+	for (tf = 0; tf < frames; tf += PCM_COPY_TILE_FRAMES) { \
+		unsigned int const tf_end = \
+			min(tf + PCM_COPY_TILE_FRAMES, frames); \
+		for (tc = 0; tc < channels; tc += PCM_COPY_TILE_CHANNELS) { \
+			unsigned int const tc_end = \
+				min(tc + PCM_COPY_TILE_CHANNELS, channels); \
+			for (c = tc; c < tc_end; c++) { \
+				u32 *dst = channel_area(runtime, c) + frame; \
+				u8 const *s = src + tf * stride + c * (size); \
+				for (f = tf; f < tf_end; f++, s += stride) \
+					dst[f] = load_##name(s); \
+			} \
+		} \
+	} \
+} \
+ \
+static void interleave_##name(struct snd_pcm_runtime *runtime, \
+	u8 *dst, unsigned int frame, unsigned int frames) \
+{ \
+	unsigned int const channels = runtime->channels; \
+	size_t const stride = channels * (size); \
+	unsigned int tf = 0; \
+	unsigned int tc = 0; \
+	unsigned int c = 0; \
+	unsigned int f = 0; \
+ \
+	for (tf = 0; tf < frames; tf += PCM_COPY_TILE_FRAMES) { \
+		unsigned int const tf_end = \
+			min(tf + PCM_COPY_TILE_FRAMES, frames); \
+		for (tc = 0; tc < channels; tc += PCM_COPY_TILE_CHANNELS) { \
+			unsigned int const tc_end = \
+				min(tc + PCM_COPY_TILE_CHANNELS, channels); \
+			for (c = tc; c < tc_end; c++) { \
+				u32 const *src = \
+					channel_area(runtime, c) + frame; \
+				u8 *d = dst + tf * stride + c * (size); \
+				for (f = tf; f < tf_end; f++, d += stride) \
+					store_##name(d, src[f]); \
+			} \
+		} \
+	} \
+} \
+ \
+static void expand_##name(u32 *dst, u8 const *src, unsigned int samples) \
+{ \
+	unsigned int i = 0; \
+ \
+	for (i = 0; i < samples; i++, src += (size)) \
+		dst[i] = load_##name(src); \
+} \
+ \
+static void pack_##name(u8 *dst, u32 const *src, unsigned int samples) \
+{ \
+	unsigned int i = 0; \
+ \
+	for (i = 0; i < samples; i++, dst += (size)) \
+		store_##name(dst, src[i]); \
+}
+
+DEFINE_SAMPLE_FORMAT(s32, 4)
+DEFINE_SAMPLE_FORMAT(s16, 2)
+DEFINE_SAMPLE_FORMAT(s24_3, 3)
+DEFINE_SAMPLE_FORMAT(float, 4)
+
+struct sample_format {
+	snd_pcm_format_t format;
+	unsigned int bytes;
+	void (*deinterleave)(struct snd_pcm_runtime *runtime, u8 const *src,
+		unsigned int frame, unsigned int frames);
+	void (*interleave)(struct snd_pcm_runtime *runtime, u8 *dst,
+		unsigned int frame, unsigned int frames);
+	void (*expand)(u32 *dst, u8 const *src, unsigned int samples);
+	void (*pack)(u8 *dst, u32 const *src, unsigned int samples);
+};
+
+#define SAMPLE_FORMAT(fmt, name, size) { \
+	.format = SNDRV_PCM_FORMAT_##fmt, \
+	.bytes = (size), \
+	.deinterleave = deinterleave_##name, \
+	.interleave = interleave_##name, \
+	.expand = expand_##name, \
+	.pack = pack_##name, \
+}
+
+static struct sample_format const sample_formats[] = {
+	SAMPLE_FORMAT(S32_LE, s32, 4),
+	SAMPLE_FORMAT(S16_LE, s16, 2),
+	SAMPLE_FORMAT(S24_3LE, s24_3, 3),
+	SAMPLE_FORMAT(FLOAT_LE, float, 4),
+};
+
+static struct sample_format const *get_sample_format(
+	struct snd_pcm_runtime *runtime)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < ARRAY_SIZE(sample_formats); i++)
+		if (sample_formats[i].format == runtime->format)
+			return &sample_formats[i];
+	return NULL;
+}
+
+#ifdef PCM_COPY_SIMD
+/* Transposes 4 rows of 4 samples at src, src_stride samples apart, into 4
+ * rows at dst, dst_stride samples apart. Kernel code is compiled without
+ * the vector registers, so the compiler keeps nothing in them and they do
+ * not need to be declared as clobbered. */
+static inline void transpose_4x4(u32 const *src, size_t src_stride,
+	u32 *dst, size_t dst_stride)
+{
+#ifdef CONFIG_X86_64
+	asm volatile(
+		"movdqu (%[s0]), %%xmm0\n\t"
+		"movdqu (%[s1]), %%xmm1\n\t"
+		"movdqu (%[s2]), %%xmm2\n\t"
+		"movdqu (%[s3]), %%xmm3\n\t"
+		"movdqa %%xmm0, %%xmm4\n\t"
+		"punpckldq %%xmm1, %%xmm0\n\t"
+		"punpckhdq %%xmm1, %%xmm4\n\t"
+		"movdqa %%xmm2, %%xmm5\n\t"
+		"punpckldq %%xmm3, %%xmm2\n\t"
+		"punpckhdq %%xmm3, %%xmm5\n\t"
+		"movdqa %%xmm0, %%xmm1\n\t"
+		"punpcklqdq %%xmm2, %%xmm0\n\t"
+		"punpckhqdq %%xmm2, %%xmm1\n\t"
+		"movdqa %%xmm4, %%xmm3\n\t"
+		"punpcklqdq %%xmm5, %%xmm4\n\t"
+		"punpckhqdq %%xmm5, %%xmm3\n\t"
+		"movdqu %%xmm0, (%[d0])\n\t"
+		"movdqu %%xmm1, (%[d1])\n\t"
+		"movdqu %%xmm4, (%[d2])\n\t"
+		"movdqu %%xmm3, (%[d3])\n\t"
+		:
+		: [s0] "r" (src), [s1] "r" (src + src_stride),
+		  [s2] "r" (src + 2 * src_stride),
+		  [s3] "r" (src + 3 * src_stride),
+		  [d0] "r" (dst), [d1] "r" (dst + dst_stride),
+		  [d2] "r" (dst + 2 * dst_stride),
+		  [d3] "r" (dst + 3 * dst_stride)
+		: "memory");
+#else
+	asm volatile(
+		"ld1 {v0.4s}, [%[s0]]\n\t"
+		"ld1 {v1.4s}, [%[s1]]\n\t"
+		"ld1 {v2.4s}, [%[s2]]\n\t"
+		"ld1 {v3.4s}, [%[s3]]\n\t"
+		"trn1 v4.4s, v0.4s, v1.4s\n\t"
+		"trn2 v5.4s, v0.4s, v1.4s\n\t"
+		"trn1 v6.4s, v2.4s, v3.4s\n\t"
+		"trn2 v7.4s, v2.4s, v3.4s\n\t"
+		"trn1 v0.2d, v4.2d, v6.2d\n\t"
+		"trn1 v1.2d, v5.2d, v7.2d\n\t"
+		"trn2 v2.2d, v4.2d, v6.2d\n\t"
+		"trn2 v3.2d, v5.2d, v7.2d\n\t"
+		"st1 {v0.4s}, [%[d0]]\n\t"
+		"st1 {v1.4s}, [%[d1]]\n\t"
+		"st1 {v2.4s}, [%[d2]]\n\t"
+		"st1 {v3.4s}, [%[d3]]\n\t"
+		:
+		: [s0] "r" (src), [s1] "r" (src + src_stride),
+		  [s2] "r" (src + 2 * src_stride),
+		  [s3] "r" (src + 3 * src_stride),
+		  [d0] "r" (dst), [d1] "r" (dst + dst_stride),
+		  [d2] "r" (dst + 2 * dst_stride),
+		  [d3] "r" (dst + 3 * dst_stride)
+		: "memory");
+#endif
+}
+
+static bool simd_begin(void)
+{
+	if (!may_use_simd())
+		return false;
+#ifdef CONFIG_X86_64
+	kernel_fpu_begin();
+#else
+	kernel_neon_begin();
+#endif
+	return true;
+}
+
+static void simd_end(void)
+{
+#ifdef CONFIG_X86_64
+	kernel_fpu_end();
+#else
+	kernel_neon_end();
+#endif
+}
+
+/* Writes the rows x cols samples at src, rows are src_stride samples apart,
+ * as cols x rows samples to dst, rows are dst_stride samples apart. Tiles
+ * of row_tile x col_tile samples are done one after the other like in the
+ * scalar loops, within a tile 4 x 4 blocks are transposed with SIMD and the
+ * edges sample by sample. Must be called between simd_begin() and
+ * simd_end(). */
+static void transpose_s32(u32 const *src, size_t src_stride, u32 *dst,
+	size_t dst_stride, unsigned int rows, unsigned int cols,
+	unsigned int row_tile, unsigned int col_tile)
+{
+	unsigned int tr = 0;
+	unsigned int tc = 0;
+	unsigned int r = 0;
+	unsigned int c = 0;
+
+	for (tr = 0; tr < rows; tr += row_tile) {
+		unsigned int const tr_end = min(tr + row_tile, rows);
+		for (tc = 0; tc < cols; tc += col_tile) {
+			unsigned int const tc_end = min(tc + col_tile, cols);
+			for (r = tr; r + 4 <= tr_end; r += 4) {
+				for (c = tc; c + 4 <= tc_end; c += 4)
+					transpose_4x4(src + r * src_stride + c,
+						src_stride,
+						dst + c * dst_stride + r,
+						dst_stride);
+				for (; c < tc_end; c++) {
+					unsigned int i = 0;
+					for (i = r; i < r + 4; i++)
+						dst[c * dst_stride + i] =
+							src[i * src_stride + c];
+				}
+			}
+			for (; r < tr_end; r++)
+				for (c = tc; c < tc_end; c++)
+					dst[c * dst_stride + r] =
+						src[r * src_stride + c];
+		}
+	}
+}
+#endif
+
+static void deinterleave(struct snd_pcm_runtime *runtime,
+	struct sample_format const *fmt, u8 const *src, unsigned int frame,
+	unsigned int frames)
+{
+#ifdef PCM_COPY_SIMD
+	if (fmt->format == SNDRV_PCM_FORMAT_S32_LE && simd_begin()) {
+		transpose_s32((u32 const *)src, runtime->channels,
+			channel_area(runtime, 0) + frame, runtime->buffer_size,
+			frames, runtime->channels,
+			PCM_COPY_TILE_FRAMES, PCM_COPY_TILE_CHANNELS);
+		simd_end();
+		return;
+	}
+#endif
+	fmt->deinterleave(runtime, src, frame, frames);
+}
+
+static void interleave(struct snd_pcm_runtime *runtime,
+	struct sample_format const *fmt, u8 *dst, unsigned int frame,
+	unsigned int frames)
+{
+#ifdef PCM_COPY_SIMD
+	if (fmt->format == SNDRV_PCM_FORMAT_S32_LE && simd_begin()) {
+		transpose_s32(channel_area(runtime, 0) + frame,
+			runtime->buffer_size, (u32 *)dst, runtime->channels,
+			runtime->channels, frames,
+			PCM_COPY_TILE_CHANNELS, PCM_COPY_TILE_FRAMES);
+		simd_end();
+		return;
+	}
+#endif
+	fmt->interleave(runtime, dst, frame, frames);
+}
+
+/* pos and bytes count whole frames. The frames are staged in the bounce
+ * buffer, so the transpose runs on kernel memory between the user copies,
+ * where SIMD may be used. */
+static int copy_interleaved(struct snd_pcm_substream *substream,
+	struct sample_format const *fmt, unsigned long pos,
+	struct copy_io *io, unsigned long bytes)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct pcm_copy *copy = runtime->private_data;
+	size_t const frame_bytes = runtime->channels * fmt->bytes;
+	unsigned int const chunk = copy->bounce_bytes / frame_bytes;
+	unsigned int frame = pos / frame_bytes;
+	unsigned int frames = bytes / frame_bytes;
+	int err = 0;
+
+	while (frames > 0) {
+		unsigned int const n = min(frames, chunk);
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+			err = io_read(io, copy->bounce, n * frame_bytes);
+			if (err < 0)
+				return err;
+			deinterleave(runtime, fmt, (u8 *)copy->bounce, frame, n);
+		} else {
+			interleave(runtime, fmt, (u8 *)copy->bounce, frame, n);
+			err = io_write(io, copy->bounce, n * frame_bytes);
+			if (err < 0)
+				return err;
+		}
+		frame += n;
+		frames -= n;
+	}
+	return 0;
+}
+
+// pos and bytes count samples of the channel in the application format
+static int copy_channel(struct snd_pcm_substream *substream,
+	struct sample_format const *fmt, int channel, unsigned long pos,
+	struct copy_io *io, unsigned long bytes)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct pcm_copy *copy = runtime->private_data;
+	unsigned int const chunk = copy->bounce_bytes / fmt->bytes;
+	u32 *area = channel_area(runtime, channel) + pos / fmt->bytes;
+	unsigned int samples = bytes / fmt->bytes;
+	int err = 0;
+
+	// the DMA format needs no conversion
+	if (fmt->format == SNDRV_PCM_FORMAT_S32_LE) {
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+			return io_read(io, area, bytes);
+		return io_write(io, area, bytes);
+	}
+	while (samples > 0) {
+		unsigned int const n = min(samples, chunk);
+		if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+			err = io_read(io, copy->bounce, n * fmt->bytes);
+			if (err < 0)
+				return err;
+			fmt->expand(area, (u8 *)copy->bounce, n);
+		} else {
+			fmt->pack((u8 *)copy->bounce, area, n);
+			err = io_write(io, copy->bounce, n * fmt->bytes);
+			if (err < 0)
+				return err;
+		}
+		area += n;
+		samples -= n;
+	}
+	return 0;
+}
+
+/* With interleaved access the PCM core passes channel 0 and pos and bytes
+ * refer to whole frames, otherwise they refer to the samples of the
+ * channel. */
+static int transfer(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, struct copy_io *io, unsigned long bytes)
+{
+	struct sample_format const *fmt =
+		get_sample_format(substream->runtime);
+
+	if (fmt == NULL)
+		return -EINVAL;
+	if (substream->runtime->access == SNDRV_PCM_ACCESS_RW_INTERLEAVED)
+		return copy_interleaved(substream, fmt, pos, io, bytes);
+	return copy_channel(substream, fmt, channel, pos, io, bytes);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+int pcm_copy(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, struct iov_iter *iter, unsigned long bytes)
+{
+	struct copy_io io = { .iter = iter };
+
+	return transfer(substream, channel, pos, &io, bytes);
+}
+#else
+int pcm_copy_user(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, void __user *buf, unsigned long bytes)
+{
+	struct copy_io io = { .ubuf = buf, .kbuf = NULL };
+
+	return transfer(substream, channel, pos, &io, bytes);
+}
+
+int pcm_copy_kernel(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, void *buf, unsigned long bytes)
+{
+	struct copy_io io = { .ubuf = NULL, .kbuf = buf };
+
+	return transfer(substream, channel, pos, &io, bytes);
+}
+#endif
+
+int pcm_copy_fill_silence(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, unsigned long bytes)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct sample_format const *fmt = get_sample_format(runtime);
+	size_t frame_bytes = 0;
+	unsigned int c = 0;
+
+	if (fmt == NULL)
+		return -EINVAL;
+	// silence is zero in all supported formats, see transfer() for pos
+	if (runtime->access == SNDRV_PCM_ACCESS_RW_INTERLEAVED) {
+		frame_bytes = runtime->channels * fmt->bytes;
+		for (c = 0; c < runtime->channels; c++)
+			memset(channel_area(runtime, c) + pos / frame_bytes, 0,
+				bytes / frame_bytes * sizeof(u32));
+	} else {
+		memset(channel_area(runtime, channel) + pos / fmt->bytes, 0,
+			bytes / fmt->bytes * sizeof(u32));
+	}
+	// silence is not covered by the syncs of the PCM core
+	if (runtime->dma_buffer_p != NULL)
+		generic_sync_dma_buffer(runtime->dma_buffer_p);
+	return 0;
+}
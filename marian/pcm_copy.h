@@ -0,0 +1,72 @@
+/*
+ * MARIAN PCIe soundcards ALSA driver
+ *
+ * Author: Tobias Groß <theguy@audio-fpga.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details at:
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+#ifndef MARIAN_PCM_COPY_H
+#define MARIAN_PCM_COPY_H
+
+#include <linux/types.h>
+#include <linux/version.h>
+#include <sound/pcm.h>
+
+// interleaved frames are staged in a buffer of (at least) this size
+#define PCM_COPY_BOUNCE_BYTES (32 * 1024)
+// smallest application sample, in bytes (S16_LE)
+#define PCM_COPY_MIN_SAMPLE_BYTES 2
+// a transposed tile, 16 samples of the DMA buffer fill a cache line
+#define PCM_COPY_TILE_CHANNELS 16
+#define PCM_COPY_TILE_FRAMES 16
+
+/* Read/write access to the DMA buffer, in which each channel occupies
+ * buffer_size consecutive samples. Interleaved frames are transposed from
+ * and to that layout by the driver, so applications do not need the plug
+ * layer of alsa-lib. S16_LE, S24_3LE and FLOAT_LE samples are converted
+ * from and to the 32 bit DMA samples on the way. mmap access stays
+ * non-interleaved and S32_LE. */
+struct pcm_copy {
+	// position of the first channel of the substream in the DMA buffer
+	unsigned int first_channel;
+	size_t bounce_bytes;
+	u32 *bounce;
+};
+
+int pcm_copy_open(struct snd_pcm_substream *substream,
+	unsigned int first_channel);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+int pcm_copy(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, struct iov_iter *iter, unsigned long bytes);
+#else
+int pcm_copy_user(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, void __user *buf, unsigned long bytes);
+int pcm_copy_kernel(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, void *buf, unsigned long bytes);
+#endif
+int pcm_copy_fill_silence(struct snd_pcm_substream *substream, int channel,
+	unsigned long pos, unsigned long bytes);
+
+// PCM ops entries of the copy callbacks
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define PCM_COPY_OPS \
+	.copy = pcm_copy, \
+	.fill_silence = pcm_copy_fill_silence
+#else
+#define PCM_COPY_OPS \
+	.copy_user = pcm_copy_user, \
+	.copy_kernel = pcm_copy_kernel, \
+	.fill_silence = pcm_copy_fill_silence
+#endif
+
+#endif